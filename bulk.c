@@ -7,11 +7,16 @@
 #include <libusb.h>
 #include <stdio.h>
 #include <unistd.h>		/* getopt(), optind */
+#include <signal.h>		/* sigaction() */
 
 #include "usb.h"
+#include "stream.h"
+#include "pattern.h"
 
-static int run_usb(libusb_context *ctx, libusb_device_handle *hdev, int n, int argc, char **argv)
+static int run_usb(libusb_context *ctx, libusb_device_handle *hdev, int n,
+                   struct hist *lat, FILE *ts_log, int argc, char **argv)
 {
+	uint64_t t0 = 0, t1;
 	int r;
 	if (argc < 2 || argc > 3)
 		return 1;
@@ -32,7 +37,22 @@ static int run_usb(libusb_context *ctx, libusb_device_handle *hdev, int n, int a
 		}
 
 		int tferd = 0;
+		if (lat || ts_log)
+			t0 = mono_ns();
 		r = libusb_bulk_transfer(hdev, ep, buf, len, &tferd, timeout);
+		if (lat || ts_log) {
+			t1 = mono_ns();
+			if (lat && !r)
+				hist_add(lat, t1 - t0);
+			if (ts_log)
+				stream_log(ts_log, ep, t0, t1,
+				           r ? libusb_error_name(r) : "completed",
+				           tferd);
+		}
+		if (lat && stream_report_req) {
+			stream_report_req = 0;
+			hist_report(lat, "bulk", stderr);
+		}
 		if (r) {
 			fprintf(stderr, "error during bulk transfer: %s\n",
 				libusb_error_name(r));
@@ -48,15 +68,305 @@ static int run_usb(libusb_context *ctx, libusb_device_handle *hdev, int n, int a
 	return 0;
 }
 
+static int fill_file(struct stream *s, uint8_t *buf, unsigned len)
+{
+	FILE *f = s->priv;
+	size_t r = fread(buf, 1, len, f);
+	if (!r && ferror(f)) {
+		fprintf(stderr, "error reading %u bytes for ep 0x%02x: %s\n",
+			len, s->ep, strerror(errno));
+		return -1;
+	}
+	return r;
+}
+
+static int drain_file(struct stream *s, const uint8_t *buf, unsigned len)
+{
+	if (len && !fwrite(buf, len, 1, s->priv)) {
+		fprintf(stderr, "error writing %u bytes from ep 0x%02x: %s\n",
+			len, s->ep, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int fill_pattern(struct stream *s, uint8_t *buf, unsigned len)
+{
+	pattern_fill(s->priv, buf, len);
+	return len;
+}
+
+static int drain_check(struct stream *s, const uint8_t *buf, unsigned len)
+{
+	checker_feed(s->priv, buf, len);
+	return 0;
+}
+
+/* an endpoint streamed asynchronously, see -e */
+struct ep_spec {
+	uint8_t ep;
+	unsigned len;
+	unsigned depth;
+	const char *path;	/* NULL or "-": stdin / stdout */
+	FILE *f;
+	struct stream s;
+	struct ring ring;
+	uint8_t *ring_mem;	/* -z: provided by stream_buf_alloc() */
+	int ring_dev_mem;
+	int use_pattern;	/* generate (OUT) or check (IN) instead of f */
+	struct hist lat;
+	struct pattern gen;
+	struct checker chk;
+	long left;		/* transfers left to do, < 0: infinite */
+	uint64_t total;		/* bytes over all runs */
+	double rate;		/* bytes/s of the last run */
+};
+
+static int parse_ep_spec(struct ep_spec *e, const char *arg, unsigned depth)
+{
+	char *endptr;
+	unsigned long ep = strtoul(arg, &endptr, 0);
+
+	memset(e, 0, sizeof(*e));
+	e->depth = depth;
+	if (*endptr != ':' || ep > 0xff)
+		goto err;
+	e->ep = ep;
+	e->len = strtoul(endptr + 1, &endptr, 0);
+	if (*endptr == ':' && endptr[1] != ':' && endptr[1])
+		e->depth = strtoul(endptr + 1, &endptr, 0);
+	else if (*endptr == ':')
+		endptr++;
+	if (*endptr == ':')
+		e->path = endptr + 1;
+	else if (*endptr)
+		goto err;
+	if (!e->len || !e->depth)
+		goto err;
+	return 0;
+err:
+	fprintf(stderr, "invalid endpoint specification: '%s'\n", arg);
+	return 1;
+}
+
+static int ep_open(struct ep_spec *e)
+{
+	int in = e->ep & 0x80;
+
+	if (e->use_pattern)
+		e->f = NULL;
+	else if (!e->path || !strcmp(e->path, "-"))
+		e->f = in ? stdout : stdin;
+	else if (!(e->f = fopen(e->path, in ? "wb" : "rb"))) {
+		perror(e->path);
+		return 1;
+	}
+	return 0;
+}
+
+static void ep_close(struct ep_spec *e)
+{
+	if (e->f && e->f != stdin && e->f != stdout)
+		fclose(e->f);
+	e->f = NULL;
+}
+
+/* keeps <depth> asynchronous transfers in flight on each endpoint, serviced
+ * by a single event loop */
+static void ep_ring_fini(struct ep_spec *e, libusb_device_handle *hdev)
+{
+	/* ring_fini() clears nslots, the length of ring_mem */
+	if (e->ring_mem)
+		stream_buf_free(hdev, e->ring_mem,
+		                (size_t)e->ring.nslots * e->len,
+		                e->ring_dev_mem);
+	e->ring_mem = NULL;
+	ring_fini(&e->ring);
+}
+
+static int run_usb_async(
+	libusb_context *ctx, libusb_device_handle *hdev, unsigned slots,
+	unsigned timeout, int latency, FILE *ts_log, int zerocopy,
+	struct ep_spec *eps, unsigned n_eps
+) {
+	struct stream **ss = calloc(n_eps, sizeof(*ss));
+	unsigned i, started = 0;
+	int r = 3;
+
+	if (!ss)
+		return 3;
+	for (i=0; i<n_eps; i++) {
+		struct ep_spec *e = eps + i;
+		struct stream s = STREAM_INIT(hdev, e->ep, e->len, e->depth,
+		                              timeout, e->left);
+		e->s = s;
+		e->s.fill = fill_file;
+		e->s.drain = drain_file;
+		ss[i] = &e->s;
+		e->s.priv = e->f;
+		e->s.lat = latency ? &e->lat : NULL;
+		e->s.ts_log = ts_log;
+		e->s.zerocopy = zerocopy;
+		if (e->use_pattern) {
+			e->s.fill = fill_pattern;
+			e->s.drain = drain_check;
+			e->s.priv = e->ep & 0x80 ? (void *)&e->chk
+			                         : (void *)&e->gen;
+		} else if (slots && (e->ep & 0x80)) {
+			/* USB completions only hand buffers to the writer */
+			e->ring_mem = NULL;
+			if (zerocopy && !(e->ring_mem = stream_buf_alloc(hdev,
+			                        (size_t)slots * e->len, 1,
+			                        &e->ring_dev_mem)))
+				goto out;
+			if (ring_init(&e->ring, slots, e->len, e->f,
+			              e->ring_mem)) {
+				if (e->ring_mem)
+					stream_buf_free(hdev, e->ring_mem,
+					                (size_t)slots * e->len,
+					                e->ring_dev_mem);
+				e->ring_mem = NULL;
+				goto out;
+			}
+			e->s.ring = &e->ring;
+			e->s.drain = NULL;
+		}
+		if (stream_init(&e->s))
+			goto out;
+		if (e->s.ring && ring_start(&e->ring)) {
+			stream_fini(&e->s);
+			goto out;
+		}
+		started++;
+	}
+
+	r = stream_run_all(ctx, ss, n_eps);
+	for (i=0; i<n_eps; i++)
+		if (eps[i].s.ring && ring_finish(&eps[i].ring) && !r)
+			r = 7;
+	for (i=0; i<n_eps; i++) {
+		struct ep_spec *e = eps + i;
+		double dt = (e->s.t_end - e->s.t_start) * 1e-9;
+		if (e->left > 0)
+			e->left -= e->s.completed;
+		e->total += e->s.bytes;
+		e->rate = dt > 0 ? e->s.bytes / dt : 0;
+		stream_report(&eps[i].s, stderr);
+		if (eps[i].s.ring)
+			ring_report(&eps[i].ring, stderr);
+		if (eps[i].s.ring && zerocopy)
+			fprintf(stderr, "ep 0x%02x: ring slots %s\n", eps[i].ep,
+				eps[i].ring_dev_mem ? "zero-copy (usbfs mmap)"
+				                    : "on the heap, zero-copy "
+				                      "unsupported");
+		if ((eps[i].ep & 0x80) && eps[i].f && fflush(eps[i].f) && !r)
+			r = 7;
+	}
+
+out:
+	if (started < n_eps && eps[started].s.ring)
+		/* setup of endpoint #started failed */
+		ep_ring_fini(eps + started, hdev);
+	for (i=0; i<started; i++) {
+		stream_fini(&eps[i].s);
+		if (eps[i].s.ring)
+			ep_ring_fini(eps + i, hdev);
+	}
+	free(ss);
+	return r;
+}
+
+static int eps_gone(const struct ep_spec *eps, unsigned n_eps)
+{
+	unsigned i;
+	for (i=0; i<n_eps; i++)
+		if (eps[i].s.gone)
+			return 1;
+	return 0;
+}
+
+/* reports the checkers of IN endpoints, returns 1 if any saw errors */
+static int eps_check_report(const struct ep_spec *eps, unsigned n_eps)
+{
+	char name[16];
+	unsigned i;
+	int r = 0;
+
+	for (i=0; i<n_eps; i++) {
+		if (!eps[i].use_pattern || ~eps[i].ep & 0x80)
+			continue;
+		snprintf(name, sizeof(name), "ep 0x%02x", eps[i].ep);
+		checker_report(&eps[i].chk, name, stderr);
+		if (eps[i].chk.bit_errors || eps[i].chk.resyncs)
+			r = 1;
+	}
+	return r;
+}
+
+/* waits for the lost device to come back, logging the gap per endpoint */
+static int reattach(
+	struct usb_common *uc, const struct usb_ident *id,
+	struct ep_spec *eps, unsigned n_eps, unsigned timeout_ms, FILE *log
+) {
+	uint64_t gap;
+	unsigned i;
+	int r;
+
+	fprintf(stderr, "device lost, waiting for it to re-appear...\n");
+	r = usb_common_reattach(uc, id, timeout_ms);
+	for (i=0; i<n_eps; i++) {
+		gap = mono_ns() - eps[i].s.t_end;
+		fprintf(log, "gap: ep 0x%02x after %" PRIu64 " bytes: %.3f ms, "
+			"~%.0f bytes lost%s\n", eps[i].ep, eps[i].total,
+			gap * 1e-6, eps[i].rate * gap * 1e-9,
+			r ? ", device did not return" : "");
+	}
+	fflush(log);
+	return r;
+}
+
+static void on_sigusr1(int sig)
+{
+	stream_report_req = 1;
+}
+
 #define USAGE(ret,progname,uc)	FATAL(ret,"\
 usage: %s %s <ep> <wLength> [<timeout_ms>]\n\
+       %s %s -e <ep>:<wLength>[:[<depth>][:<file>]] [-e ...] [<timeout_ms>]\n\
 \n\
 %s\
   -C <num>    continuous transfers, 0 for infinite, stop on error (default: 1)\n\
   -d <delay>  release USB device for <delay> ms between transfers (default: 0)\n\
+  -k <keep>   with -d, keep libusb and the device open between transfers:\n\
+              'dev' keeps the device reference, closing the handle; 'handle'\n\
+              keeps the handle, releasing the interface (default: neither)\n\
+  -Q <depth>  keep <depth> asynchronous transfers in flight (default: 0, sync)\n\
+  -R <slots>  IN only: write from a separate thread, buffering up to <slots>\n\
+              transfers in a ring (implies -Q 4 unless given)\n\
+  -P <ms>     when the device disappears, wait up to <ms> (0: forever) for\n\
+              it to re-enumerate with the same VID:PID and serial, then\n\
+              resume streaming into the same output (implies -Q 4)\n\
+  -L <log>    log gaps caused by -P to file <log> (default: stderr)\n\
+  -l          record the latency of each transfer, print histograms on exit\n\
+              and on SIGUSR1\n\
+  -T <log>    log submission and completion timestamps (ns, CLOCK_MONOTONIC)\n\
+              of each transfer to file <log>\n\
+  -z          allocate transfer buffers with libusb_dev_mem_alloc(), avoiding\n\
+              copies between kernel and user space where usbfs supports it\n\
+              (implies -Q 4)\n\
+  -g <pat>    send pattern <pat> on OUT endpoints instead of reading input\n\
+  -v <pat>    check data received on IN endpoints against pattern <pat>\n\
+              instead of writing it, reporting bit errors, the first error's\n\
+              offset and resynchronizations; -g and -v imply -Q 4\n\
+              <pat>: %s\n\
+  -e <spec>   stream <ep> asynchronously with <depth> transfers (default: -Q)\n\
+              in flight, reading from / writing to <file> (default: stdin /\n\
+              stdout); may be given multiple times, all endpoints are\n\
+              serviced concurrently\n\
 \n\
 Transfer direction: (<ep> & 0x80) ? device to host : host to device\n\
-",progname,usb_common_usage(uc),usb_common_help(uc))
+",progname,usb_common_usage(uc),progname,usb_common_usage(uc),\
+usb_common_help(uc),pattern_help)
 
 int main(int argc, char **argv)
 {
@@ -65,35 +375,190 @@ int main(int argc, char **argv)
 	int opt;
 	int n = 1;
 	int delay = 0;
+	unsigned depth = 0;
+	unsigned slots = 0;
+	const char **specs = NULL;
+	unsigned n_specs = 0;
+	struct ep_spec *eps = NULL;
+	unsigned i;
+	enum usb_keep keep = USB_KEEP_NONE;
+	uint64_t t0, dt, dt_min = UINT64_MAX, dt_max = 0, dt_sum = 0;
+	long cycles = 0;
+	int persist = 0;
+	unsigned persist_ms = 0;
+	struct usb_ident ident;
+	int have_ident = 0;
+	FILE *gap_log = stderr;
+	const char *gen = NULL, *check = NULL;
+	struct pattern pat_gen, pat_check;
+	int latency = 0;
+	struct hist lat;
+	FILE *ts_log = NULL;
+	int zerocopy = 0;
 
 	r = usb_common_parse_opts(&uc, argc, argv);
 	if (r)
 		return 1;
 
-	while ((opt = getopt(argc, argv, ":C:d:h")) != -1)
+	while ((opt = getopt(argc, argv, ":C:d:k:Q:R:P:L:lT:zg:v:e:h")) != -1)
 		switch (opt) {
 		case 'C': n = strtol(optarg, NULL, 0); break;
 		case 'd': delay = strtol(optarg, NULL, 0); break;
+		case 'k':
+			if (!strcmp(optarg, "dev"))
+				keep = USB_KEEP_DEVICE;
+			else if (!strcmp(optarg, "handle"))
+				keep = USB_KEEP_HANDLE;
+			else
+				FATAL(1,"invalid argument for option '-k': "
+				        "'%s'\n",optarg);
+			break;
+		case 'Q': depth = strtoul(optarg, NULL, 0); break;
+		case 'R': slots = strtoul(optarg, NULL, 0); break;
+		case 'P':
+			persist = 1;
+			persist_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			if (!(gap_log = fopen(optarg, "a"))) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'l': latency = 1; break;
+		case 'T':
+			if (!(ts_log = fopen(optarg, "w"))) {
+				perror(optarg);
+				return 1;
+			}
+			fprintf(ts_log, "# ep submit_ns complete_ns status "
+			        "bytes\n");
+			break;
+		case 'z': zerocopy = 1; break;
+		case 'g': gen = optarg; break;
+		case 'v': check = optarg; break;
+		case 'e':
+			specs = realloc(specs, (n_specs + 1) * sizeof(*specs));
+			specs[n_specs++] = optarg;
+			break;
 		case 'h': USAGE(0,argv[0],&uc);
 		case '?': FATAL(1,"illegal option: '-%c'\n", optopt);
 		}
 
-	if (argc - optind < 2 || argc - optind > 3)
+	if (n_specs ? argc - optind > 1
+	            : argc - optind < 2 || argc - optind > 3)
 		USAGE(1,argv[0],&uc);
 
+	if ((gen && pattern_parse(&pat_gen, gen)) ||
+	    (check && pattern_parse(&pat_check, check)))
+		return 1;
+
+	if ((slots || n_specs || persist || gen || check || zerocopy) && !depth)
+		depth = 4;
+
+	unsigned timeout = 500;
+	if (n_specs) {
+		eps = calloc(n_specs, sizeof(*eps));
+		for (i=0; i<n_specs; i++)
+			if (parse_ep_spec(eps + i, specs[i], depth))
+				return 1;
+		if (argc - optind > 0)
+			timeout = strtol(argv[optind], NULL, 0);
+	} else if (depth) {
+		eps = calloc(1, sizeof(*eps));
+		n_specs = 1;
+		eps->ep = strtol(argv[optind], NULL, 0);
+		eps->len = strtol(argv[optind + 1], NULL, 0);
+		eps->depth = depth;
+		if (argc - optind > 2)
+			timeout = strtol(argv[optind + 2], NULL, 0);
+	}
+	hist_init(&lat);
+	if (latency)
+		sigaction(SIGUSR1, &(struct sigaction){
+			.sa_handler = on_sigusr1, .sa_flags = SA_RESTART,
+		}, NULL);
+
+	for (i=0; i<n_specs; i++) {
+		hist_init(&eps[i].lat);
+		if (eps[i].ep & 0x80 ? !!check : !!gen) {
+			eps[i].use_pattern = 1;
+			if (eps[i].ep & 0x80)
+				checker_init(&eps[i].chk, &pat_check);
+			else
+				eps[i].gen = pat_gen;
+		}
+		if (slots && slots < eps[i].depth)
+			FATAL(1,"ring of %u slots cannot hold %u transfers in "
+			        "flight\n", slots, eps[i].depth);
+		if (n_specs > 1 && !eps[i].path && !eps[i].use_pattern)
+			FATAL(1,"<file> required for each of multiple "
+			        "endpoints\n");
+		if (ep_open(eps + i))
+			return 1;
+	}
+
 	do {
-		r = usb_common_setup(&uc);
+		t0 = mono_ns();
+		r = usb_common_resume(&uc);
 		if (r)
 			return 2;
+		if (delay) {
+			dt = mono_ns() - t0;
+			if (dt < dt_min)
+				dt_min = dt;
+			if (dt > dt_max)
+				dt_max = dt;
+			dt_sum += dt;
+			fprintf(stderr, "cycle %ld: setup took %.3f ms\n",
+				cycles++, dt * 1e-6);
+		}
+
+		if (persist && !have_ident++ && usb_common_identify(&uc, &ident))
+			return 2;
 
-		r = run_usb(uc.ctx, uc.hdev, delay ? 1 : n, argc - optind, argv + optind);
+		if (n_specs) {
+			for (i=0; i<n_specs; i++)
+				eps[i].left = delay ? 1 : n > 0 ? n : -1;
+			r = run_usb_async(uc.ctx, uc.hdev, slots, timeout,
+			                  latency, ts_log, zerocopy, eps, n_specs);
+			while (r && persist && eps_gone(eps, n_specs)) {
+				if ((r = reattach(&uc, &ident, eps, n_specs,
+				                  persist_ms, gap_log)))
+					break;
+				r = run_usb_async(uc.ctx, uc.hdev, slots,
+				                  timeout, latency, ts_log,
+				                  zerocopy, eps, n_specs);
+			}
+		} else
+			r = run_usb(uc.ctx, uc.hdev, delay ? 1 : n,
+			            latency ? &lat : NULL, ts_log,
+			            argc - optind, argv + optind);
 		if (r)
 			fprintf(stderr, "run_usb failed with code %d\n", r);
 
-		usb_common_teardown(&uc);
+		usb_common_suspend(&uc, keep);
 		if (delay)
 			nanosleep(&(struct timespec){ delay / 1000, (delay % 1000) * 1e6 }, NULL);
 	} while (delay && (n < 0 || n--));
 
+	usb_common_teardown(&uc);
+	if (eps_check_report(eps, n_specs) && !r)
+		r = 8;
+	if (cycles)
+		fprintf(stderr, "setup over %ld cycles: min %.3f ms, avg %.3f "
+			"ms, max %.3f ms\n", cycles, dt_min * 1e-6,
+			dt_sum * 1e-6 / cycles, dt_max * 1e-6);
+
+	for (i=0; i<n_specs; i++)
+		ep_close(eps + i);
+	free(eps);
+	free(specs);
+	if (gap_log != stderr)
+		fclose(gap_log);
+	if (latency && !n_specs)
+		hist_report(&lat, "bulk", stderr);
+	if (ts_log)
+		fclose(ts_log);
 	return r;
 }
@@ -2,8 +2,24 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <inttypes.h>
+#include <time.h>
+
 /* helper macros */
 #define ARRAY_SIZE(arr)		(sizeof(arr)/sizeof(*(arr)))
 #define FATAL(ret,...)		do { fprintf(stderr, __VA_ARGS__); exit(ret); } while (0)
 
+static inline uint64_t ts_ns(const struct timespec *t)
+{
+	return t->tv_sec * UINT64_C(1000000000) + t->tv_nsec;
+}
+
+/* monotonic time in ns, requires _POSIX_C_SOURCE >= 199309L */
+static inline uint64_t mono_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ts_ns(&t);
+}
+
 #endif
@@ -7,80 +7,483 @@
 #include <libusb.h>
 #include <stdio.h>
 #include <unistd.h>		/* getopt(), optind */
+#include <signal.h>		/* sigaction() */
+#include <time.h>		/* clock_nanosleep() */
 
 #include "usb.h"
+#include "stream.h"		/* stream_log(), stream_report_req */
+#include "ctrlq.h"
 
-static int run_usb(libusb_context *ctx, libusb_device_handle *hdev, int argc, char **argv)
+/* issues one control request, returns the number of bytes transferred or a
+ * libusb error code < 0 */
+static int ctl_transfer(libusb_device_handle *hdev, struct ctrlq_req *q,
+                        unsigned timeout, struct hist *lat, FILE *ts_log)
 {
+	uint64_t t0 = 0, t1;
+	int r;
+
+	if (lat || ts_log)
+		t0 = mono_ns();
+	r = libusb_control_transfer(hdev, q->bmRequestType, q->bRequest,
+	                            q->wValue, q->wIndex, q->data, q->wLength,
+	                            timeout);
+	if (lat || ts_log) {
+		t1 = mono_ns();
+		if (lat && r >= 0)
+			hist_add(lat, t1 - t0);
+		if (ts_log)
+			stream_log(ts_log, q->bmRequestType & 0x80, t0, t1,
+			           r < 0 ? libusb_error_name(r) : "completed",
+			           r < 0 ? 0 : r);
+	}
+	if (lat && stream_report_req) {
+		stream_report_req = 0;
+		hist_report(lat, "control", stderr);
+	}
+	return r;
+}
+
+/* poll mode */
+
+struct ctl_poll {
+	uint64_t mask;
+	uint64_t expected;
+	unsigned deadline;	/* ms */
+	unsigned interval;	/* us between request starts, 0: back-to-back */
+};
+
+#define DEFAULT_POLL_DEADLINE	1000 /* ms */
+
+/* the first up to 8 bytes of a response, little-endian */
+static uint64_t ctl_value(const uint8_t *data, int len)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = len < 8 ? len : 8; i--;)
+		v = v << 8 | data[i];
+	return v;
+}
+
+/* repeats the IN request q until (value & mask) == expected or the deadline
+ * passes; the matching response is written to stdout */
+static int ctl_poll(libusb_device_handle *hdev, struct ctrlq_req *q,
+                    unsigned timeout, const struct ctl_poll *p,
+                    struct hist *lat, FILE *ts_log)
+{
+	uint64_t t0 = mono_ns(), t_next = t0, now, v = 0;
+	uint64_t t_deadline = t0 + p->deadline * UINT64_C(1000000);
+	unsigned long iter = 0;
+	int r;
+
+	while (1) {
+		r = ctl_transfer(hdev, q, timeout, lat, ts_log);
+		iter++;
+		now = mono_ns();
+		if (r < 0) {
+			fprintf(stderr, "error during control transfer %lu: "
+				"%s\n", iter, libusb_error_name(r));
+			return 3;
+		}
+		v = ctl_value(q->data, r);
+		if ((v & p->mask) == p->expected)
+			break;
+		if (now >= t_deadline) {
+			fprintf(stderr, "no match after %lu requests in %.3f "
+				"ms, last value: 0x%" PRIx64 "\n", iter,
+				(now - t0) * 1e-6, v);
+			return 4;
+		}
+		if (p->interval) {
+			t_next += p->interval * UINT64_C(1000);
+			if (t_next > t_deadline)
+				t_next = t_deadline;
+			if (t_next > now)
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&(struct timespec){
+						.tv_sec  = t_next / 1000000000,
+						.tv_nsec = t_next % 1000000000,
+					}, NULL);
+		}
+	}
+
+	fprintf(stderr, "match after %lu requests in %.3f ms: 0x%" PRIx64 "\n",
+		iter, (now - t0) * 1e-6, v);
+	fwrite(q->data, r, 1, stdout);
+	return 0;
+}
+
+static int run_usb(libusb_context *ctx, libusb_device_handle *hdev,
+                   const struct ctl_poll *poll, struct hist *lat,
+                   FILE *ts_log, int argc, char **argv)
+{
+	struct ctrlq_req q;
+
 	if (argc < 5 || argc > 6)
 		return 1;
 
-	uint8_t  bmRequestType = strtol(argv[0], NULL, 0);
-	uint8_t  bRequest      = strtol(argv[1], NULL, 0);
-	uint16_t wValue        = strtol(argv[2], NULL, 0);
-	uint16_t wIndex        = strtol(argv[3], NULL, 0);
-	uint16_t wLength       = strtol(argv[4], NULL, 0);
+	q.bmRequestType = strtol(argv[0], NULL, 0);
+	q.bRequest      = strtol(argv[1], NULL, 0);
+	q.wValue        = strtol(argv[2], NULL, 0);
+	q.wIndex        = strtol(argv[3], NULL, 0);
+	q.wLength       = strtol(argv[4], NULL, 0);
 	unsigned timeout = argc > 5 ? strtol(argv[5], NULL, 0) : 500;
 
-	uint8_t *buf = calloc(1, wLength);
+	q.data = calloc(1, q.wLength);
 
-	if (~bmRequestType & 0x80) {
+	if (poll) {
+		if (~q.bmRequestType & 0x80 || !q.wLength) {
+			fprintf(stderr, "polling requires a device to host "
+				"request with wLength > 0\n");
+			return 1;
+		}
+		return ctl_poll(hdev, &q, timeout, poll, lat, ts_log);
+	}
+
+	if (~q.bmRequestType & 0x80) {
 		/* host to device transfer */
-		if (!fread(buf, wLength, 1, stdin)) {
+		if (!fread(q.data, q.wLength, 1, stdin)) {
 			fprintf(stderr, "error reading %hu bytes from stdin: %s\n",
-				wLength, strerror(errno));
+				q.wLength, strerror(errno));
 			return 2;
 		}
 	}
 
-	int r = libusb_control_transfer(hdev, bmRequestType, bRequest, wValue, wIndex, buf, wLength, timeout);
+	int r = ctl_transfer(hdev, &q, timeout, lat, ts_log);
 	if (r < 0) {
 		fprintf(stderr, "error during control transfer: %s\n",
 			libusb_error_name(r));
 		return 3;
 	}
 
-	if (bmRequestType & 0x80) {
+	if (q.bmRequestType & 0x80) {
 		/* device to host transfer */
-		r = fwrite(buf, r, 1, stdout);
+		r = fwrite(q.data, r, 1, stdout);
+	}
+
+	return 0;
+}
+
+/* batch mode */
+
+static int hex_nibble(char c)
+{
+	if ('0' <= c && c <= '9') return c - '0';
+	if ('A' <= c && c <= 'F') return c - 'A' + 10;
+	if ('a' <= c && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+/* parses "<bmRequestType> <bRequest> <wValue> <wIndex> <wLength> [<hex>]",
+ * q->data must provide 0xffff bytes; returns 0 on success, 1 for blank and
+ * comment lines and -1 on errors */
+static int ctl_parse_req(const char *line, struct ctrlq_req *q)
+{
+	unsigned long v[5];
+	const char *p = line;
+	char *end;
+	unsigned i, n;
+	int hi, lo;
+
+	p += strspn(p, " \t\r\n");
+	if (!*p || *p == '#')
+		return 1;
+	for (i=0; i<ARRAY_SIZE(v); i++) {
+		v[i] = strtoul(p, &end, 0);
+		if (end == p || v[i] > (i < 2 ? 0xffUL : 0xffffUL))
+			return -1;
+		p = end;
+	}
+	q->bmRequestType = v[0];
+	q->bRequest      = v[1];
+	q->wValue        = v[2];
+	q->wIndex        = v[3];
+	q->wLength       = v[4];
+
+	p += strspn(p, " \t");
+	for (n = 0; (hi = hex_nibble(p[0])) >= 0 && (lo = hex_nibble(p[1])) >= 0;
+	     p += 2) {
+		if (n == q->wLength)
+			return -1;
+		q->data[n++] = hi << 4 | lo;
+	}
+	p += strspn(p, " \t\r\n");
+	if (*p)
+		return -1;
+	if (~q->bmRequestType & 0x80 && n != q->wLength)
+		return -1;
+	return 0;
+}
+
+/* prints the framed result of request #idx: "<#> ok <len> [<hex data>]" or
+ * "<#> <error>" */
+static void ctl_print_result(unsigned idx, const struct ctrlq_req *q, int r)
+{
+	int i;
+
+	if (r < 0) {
+		printf("%u %s\n", idx,
+		       r == CTRLQ_SKIPPED ? "skipped" : libusb_error_name(r));
+		return;
+	}
+	printf("%u ok %d", idx, r);
+	if (q->bmRequestType & 0x80) {
+		putchar(' ');
+		for (i=0; i<r; i++)
+			printf("%02x", q->data[i]);
+	}
+	putchar('\n');
+}
+
+static void ctl_print_summary(unsigned n, unsigned failed, uint64_t dt)
+{
+	fprintf(stderr, "%u requests, %u failed, in %.3f ms (%.1f us per "
+		"request)\n", n, failed, dt * 1e-6, n ? dt * 1e-3 / n : 0.0);
+}
+
+/* runs all requests read from in over the open handle one after another,
+ * printing one line per request, see ctl_print_result() */
+static int run_batch(libusb_device_handle *hdev, FILE *in, unsigned timeout,
+                     struct hist *lat, FILE *ts_log)
+{
+	struct ctrlq_req q;
+	char *line = NULL;
+	size_t sz = 0;
+	unsigned lineno = 0, n = 0, failed = 0;
+	uint64_t t0;
+	int r;
+
+	q.data = malloc(0xffff);
+	t0 = mono_ns();
+	while (getline(&line, &sz, in) > 0) {
+		lineno++;
+		r = ctl_parse_req(line, &q);
+		if (r > 0)
+			continue;
+		if (r < 0) {
+			fprintf(stderr, "invalid request on line %u\n", lineno);
+			printf("%u parse-error\n", n++);
+			failed++;
+			continue;
+		}
+		r = ctl_transfer(hdev, &q, timeout, lat, ts_log);
+		ctl_print_result(n++, &q, r);
+		if (r < 0)
+			failed++;
 	}
+	ctl_print_summary(n, failed, mono_ns() - t0);
+	free(line);
+	free(q.data);
+	if (ferror(in)) {
+		fprintf(stderr, "error reading requests: %s\n",
+			strerror(errno));
+		return 2;
+	}
+	return failed ? 3 : 0;
+}
 
+static int ctl_queue_done(struct ctrlq *cq, struct ctrlq_req *q)
+{
+	ctl_print_result(cq->n_done, q, q->result);
 	return 0;
 }
 
+/* reads all requests from in, then runs them keeping up to depth of them in
+ * flight; stops at the first failed request, later ones are reported as
+ * skipped */
+static int run_batch_queued(libusb_context *ctx, libusb_device_handle *hdev,
+                            FILE *in, unsigned timeout, unsigned depth,
+                            struct hist *lat, FILE *ts_log)
+{
+	struct ctrlq cq = CTRLQ_INIT(hdev, depth, timeout);
+	struct ctrlq_req *reqs = NULL, q;
+	char *line = NULL;
+	size_t sz = 0, n = 0, cap = 0, i;
+	unsigned lineno = 0;
+	uint64_t t0;
+	int r = 0;
+
+	q.data = malloc(0xffff);
+	while (getline(&line, &sz, in) > 0) {
+		lineno++;
+		r = ctl_parse_req(line, &q);
+		if (r > 0)
+			continue;
+		if (r < 0) {
+			fprintf(stderr, "invalid request on line %u\n", lineno);
+			r = 1;
+			goto out;
+		}
+		if (n == cap) {
+			struct ctrlq_req *tmp;
+			cap = cap ? 2 * cap : 64;
+			if (!(tmp = realloc(reqs, cap * sizeof(*reqs)))) {
+				r = 2;
+				goto out;
+			}
+			reqs = tmp;
+		}
+		reqs[n] = q;
+		reqs[n].data = malloc(q.wLength ? q.wLength : 1);
+		if (!reqs[n].data) {
+			r = 2;
+			goto out;
+		}
+		memcpy(reqs[n++].data, q.data, q.wLength);
+	}
+	if (ferror(in)) {
+		fprintf(stderr, "error reading requests: %s\n",
+			strerror(errno));
+		r = 2;
+		goto out;
+	}
+
+	cq.done = ctl_queue_done;
+	cq.lat = lat;
+	cq.ts_log = ts_log;
+	if ((r = ctrlq_init(&cq)))
+		goto out;
+	t0 = mono_ns();
+	r = ctrlq_run(ctx, &cq, reqs, n);
+	t0 = mono_ns() - t0;
+	for (i=cq.n_done; i<n; i++)
+		ctl_print_result(i, &reqs[i], reqs[i].result);
+	ctl_print_summary(n, n - cq.n_done, t0);
+	ctrlq_fini(&cq);
+	if (r == 5)
+		r = 3;
+out:
+	for (i=0; i<n; i++)
+		free(reqs[i].data);
+	free(reqs);
+	free(line);
+	free(q.data);
+	return r;
+}
+
+static void on_sigusr1(int sig)
+{
+	stream_report_req = 1;
+}
+
 #define USAGE(ret,progname,uc)	FATAL(ret,"\
 usage: %s %s <bmRequestType> <bRequest> <wValue> <wIndex> <wLength> [<timeout_ms>]\n\
+       %s %s -b <script> [<timeout_ms>]\n\
 \n\
 %s\
-",progname,usb_common_usage(uc),usb_common_help(uc))
+  -b <script> run all requests from file <script> ('-' for stdin) over one\n\
+              device handle, one per line:\n\
+                <bmRequestType> <bRequest> <wValue> <wIndex> <wLength> [<hex>]\n\
+              <hex> is the payload of host to device requests; '#' starts a\n\
+              comment line. For each request \"<#> ok <len> [<hex>]\" or\n\
+              \"<#> <error>\" is printed, followed by a timing summary\n\
+  -Q <depth>  with -b, keep up to <depth> requests in flight; the batch stops\n\
+              at the first failed request, later ones report \"skipped\"\n\
+  -p <mask>:<expected>[:<deadline_ms>[:<interval_us>]]\n\
+              repeat the device to host request until the little-endian value\n\
+              of its first up to 8 response bytes masked by <mask> equals\n\
+              <expected>, or fail with code 4 after <deadline_ms> (default:\n\
+              %d); requests start every <interval_us> (default: 0, back-to-\n\
+              back). Prints the number of requests and the time to match.\n\
+  -l          record the latency of each transfer, print a histogram on exit\n\
+              and on SIGUSR1\n\
+  -T <log>    log submission and completion timestamps (ns, CLOCK_MONOTONIC)\n\
+              of each transfer to file <log>\n\
+",progname,usb_common_usage(uc),progname,usb_common_usage(uc),\
+usb_common_help(uc),DEFAULT_POLL_DEADLINE)
 
 int main(int argc, char **argv)
 {
 	struct usb_common uc = USB_COMMON_INIT(NULL,0,-2,-2);
 	int r;
 	int opt;
+	int latency = 0;
+	struct hist lat;
+	FILE *ts_log = NULL;
+	const char *script = NULL;
+	FILE *in = NULL;
+	unsigned depth = 0;
+	struct ctl_poll poll = { 0, 0, DEFAULT_POLL_DEADLINE, 0 };
+	const char *spoll = NULL;
 
 	r = usb_common_parse_opts(&uc, argc, argv);
 	if (r)
 		return 1;
 
-	while ((opt = getopt(argc, argv, ":h")) != -1)
+	while ((opt = getopt(argc, argv, ":b:Q:p:lT:h")) != -1)
 		switch (opt) {
+		case 'b': script = optarg; break;
+		case 'Q': depth = strtoul(optarg, NULL, 0); break;
+		case 'p': spoll = optarg; break;
+		case 'l': latency = 1; break;
+		case 'T':
+			if (!(ts_log = fopen(optarg, "w"))) {
+				perror(optarg);
+				return 1;
+			}
+			fprintf(ts_log, "# ep submit_ns complete_ns status "
+			        "bytes\n");
+			break;
 		case 'h': USAGE(0,argv[0],&uc);
 		case '?': FATAL(1,"illegal option: '-%c'\n", optopt);
 		}
 
-	if (argc - optind < 5 || argc - optind > 6)
+	if (script ? argc - optind > 1
+	           : argc - optind < 5 || argc - optind > 6)
 		USAGE(1,argv[0],&uc);
 
+	if (spoll) {
+		char *endptr;
+		poll.mask = strtoull(spoll, &endptr, 0);
+		if (*endptr != ':' || script)
+			FATAL(1,"invalid poll syntax (-p): %s\n",spoll);
+		poll.expected = strtoull(endptr + 1, &endptr, 0);
+		if (*endptr == ':')
+			poll.deadline = strtoul(endptr + 1, &endptr, 0);
+		if (*endptr == ':')
+			poll.interval = strtoul(endptr + 1, &endptr, 0);
+		if (*endptr)
+			FATAL(1,"invalid poll syntax (-p): %s\n",spoll);
+	}
+
+	if (script) {
+		in = strcmp(script, "-") ? fopen(script, "r") : stdin;
+		if (!in) {
+			perror(script);
+			return 1;
+		}
+	}
+
+	hist_init(&lat);
+	if (latency)
+		sigaction(SIGUSR1, &(struct sigaction){
+			.sa_handler = on_sigusr1, .sa_flags = SA_RESTART,
+		}, NULL);
+
 	r = usb_common_setup(&uc);
 	if (r)
 		return 2;
 
-	r = run_usb(uc.ctx, uc.hdev, argc - optind, argv + optind);
+	unsigned timeout = argc > optind ? strtol(argv[optind], NULL, 0) : 500;
+	if (script && depth)
+		r = run_batch_queued(uc.ctx, uc.hdev, in, timeout, depth,
+		                     latency ? &lat : NULL, ts_log);
+	else if (script)
+		r = run_batch(uc.hdev, in, timeout, latency ? &lat : NULL,
+		              ts_log);
+	else
+		r = run_usb(uc.ctx, uc.hdev, spoll ? &poll : NULL,
+		            latency ? &lat : NULL, ts_log, argc - optind,
+		            argv + optind);
 	if (r)
 		fprintf(stderr, "run_usb failed with code %d\n", r);
 
 	usb_common_teardown(&uc);
+	if (latency)
+		hist_report(&lat, "control", stderr);
+	if (ts_log)
+		fclose(ts_log);
+	if (in && in != stdin)
+		fclose(in);
 	return r;
 }
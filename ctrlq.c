@@ -0,0 +1,208 @@
+
+#define _POSIX_C_SOURCE		200809L	/* clock_gettime() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "common.h"
+#include "ctrlq.h"
+#include "stream.h"		/* stream_log(), stream_report_req */
+#include "trace.h"
+
+/* maps the transfer status to what libusb_control_transfer() would return */
+static int ctrlq_status_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED: return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL    : return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW : return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+	default                       : return LIBUSB_ERROR_IO;
+	}
+}
+
+static void LIBUSB_CALL ctrlq_cb(struct libusb_transfer *t)
+{
+	struct ctrlq_slot *c = t->user_data;
+	struct ctrlq *q = c->q;
+	struct ctrlq_req *r = c->r;
+
+	q->in_flight--;
+	q->completed = 1;
+	q->free[q->n_free++] = t;
+	q->t_end = mono_ns();
+	if (q->ts_log)
+		stream_log(q->ts_log, r->bmRequestType & 0x80, c->t_submit,
+		           q->t_end, stream_status_name(t->status),
+		           t->actual_length);
+	if (trace_file)
+		trace_span("usb", "control", c->t_submit, q->t_end,
+		           "\"bRequest\":%u,\"wValue\":%u,\"wIndex\":%u,"
+		           "\"len\":%d,\"status\":\"%s\"", r->bRequest,
+		           r->wValue, r->wIndex, t->actual_length,
+		           stream_status_name(t->status));
+	r->result = ctrlq_status_error(t->status);
+	if (r->result)
+		return;
+	r->result = t->actual_length;
+	if (r->bmRequestType & 0x80)
+		memcpy(r->data, libusb_control_transfer_get_data(t),
+		       t->actual_length);
+	if (q->lat)
+		hist_add(q->lat, q->t_end - c->t_submit);
+}
+
+static int ctrlq_submit(struct ctrlq *q, struct ctrlq_req *r)
+{
+	struct libusb_transfer *t = q->free[q->n_free - 1];
+	struct ctrlq_slot *c = t->user_data;
+	size_t len = LIBUSB_CONTROL_SETUP_SIZE + r->wLength;
+	int err;
+
+	if (c->cap < len) {
+		uint8_t *buf = realloc(t->buffer, len);
+		if (!buf)
+			return r->result = LIBUSB_ERROR_NO_MEM;
+		t->buffer = buf;
+		c->cap = len;
+	}
+	libusb_fill_control_setup(t->buffer, r->bmRequestType, r->bRequest,
+	                          r->wValue, r->wIndex, r->wLength);
+	if (~r->bmRequestType & 0x80)
+		memcpy(t->buffer + LIBUSB_CONTROL_SETUP_SIZE, r->data,
+		       r->wLength);
+	libusb_fill_control_transfer(t, q->hdev, t->buffer, ctrlq_cb, c,
+	                             q->timeout);
+	c->r = r;
+	c->t_submit = mono_ns();
+	r->result = CTRLQ_PENDING;
+	err = libusb_submit_transfer(t);
+	if (err)
+		return r->result = err;
+	q->n_free--;
+	q->in_flight++;
+	return 0;
+}
+
+static void ctrlq_cancel(struct ctrlq *q)
+{
+	unsigned i;
+
+	q->stop = 1;
+	/* transfers not in flight report LIBUSB_ERROR_NOT_FOUND, ignore */
+	for (i=0; i<q->depth; i++)
+		libusb_cancel_transfer(q->tfers[i]);
+}
+
+int ctrlq_init(struct ctrlq *q)
+{
+	unsigned i;
+
+	q->tfers = calloc(q->depth, sizeof(*q->tfers));
+	q->slots = calloc(q->depth, sizeof(*q->slots));
+	q->free = calloc(q->depth, sizeof(*q->free));
+	if (!q->tfers || !q->slots || !q->free)
+		goto err;
+	for (i=0; i<q->depth; i++) {
+		if (!(q->tfers[i] = libusb_alloc_transfer(0)))
+			goto err;
+		q->tfers[i]->buffer = NULL;
+		q->tfers[i]->user_data = &q->slots[i];
+		q->slots[i].q = q;
+		q->free[i] = q->tfers[i];
+	}
+	q->n_free = q->depth;
+	q->in_flight = 0;
+	q->stop = 0;
+	q->n_done = 0;
+	return 0;
+err:
+	fprintf(stderr, "error allocating %u control transfers\n", q->depth);
+	ctrlq_fini(q);
+	return 1;
+}
+
+void ctrlq_fini(struct ctrlq *q)
+{
+	unsigned i;
+
+	if (q->tfers)
+		for (i=0; i<q->depth && q->tfers[i]; i++) {
+			free(q->tfers[i]->buffer);
+			libusb_free_transfer(q->tfers[i]);
+		}
+	free(q->tfers);
+	free(q->slots);
+	free(q->free);
+	q->tfers = NULL;
+	q->slots = NULL;
+	q->free = NULL;
+}
+
+/* hands completed requests to q->done in order; the first failure stops the
+ * queue */
+static int ctrlq_deliver(struct ctrlq *q, struct ctrlq_req *reqs, size_t next)
+{
+	while (q->n_done < next && reqs[q->n_done].result != CTRLQ_PENDING) {
+		struct ctrlq_req *r = &reqs[q->n_done];
+		if (r->result < 0 || (q->done && q->done(q, r))) {
+			q->result = r->result;
+			ctrlq_cancel(q);
+			return 5;
+		}
+		q->n_done++;
+	}
+	return 0;
+}
+
+int ctrlq_run(
+	libusb_context *ctx, struct ctrlq *q, struct ctrlq_req *reqs, size_t n
+) {
+	size_t i, next = 0;
+	int r, err = 0;
+
+	for (i=0; i<n; i++)
+		reqs[i].result = CTRLQ_SKIPPED;
+	q->stop = 0;
+	q->n_done = 0;
+	q->result = 0;
+	q->t_start = q->t_end = mono_ns();
+
+	while (1) {
+		/* another thread may be handling events for ctx, e.g. in
+		 * hotplug mode: cleared before looking at the state so that
+		 * a completion in between is not slept through */
+		q->completed = 0;
+		if (!err)
+			err = ctrlq_deliver(q, reqs, next);
+		while (!q->stop && q->n_free && next < n)
+			if ((r = ctrlq_submit(q, &reqs[next++]))) {
+				fprintf(stderr, "error submitting control "
+					"transfer: %s\n", libusb_error_name(r));
+				/* the ones in flight still complete in order */
+				q->stop = 1;
+			}
+		if (!q->in_flight)
+			break;
+		if (q->lat && stream_report_req) {
+			stream_report_req = 0;
+			hist_report(q->lat, "control", stderr);
+		}
+		r = libusb_handle_events_completed(ctx, &q->completed);
+		if (r && r != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "error handling USB events: %s\n",
+				libusb_error_name(r));
+			if (!err)
+				err = 6;
+			ctrlq_cancel(q);
+		}
+	}
+	if (!err)
+		err = ctrlq_deliver(q, reqs, next);
+
+	return err;
+}
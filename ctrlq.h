@@ -0,0 +1,76 @@
+
+#ifndef CTRLQ_H
+#define CTRLQ_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <libusb.h>
+
+#include "hist.h"
+
+/* ctrlq_req.result of requests not (yet) run */
+#define CTRLQ_SKIPPED	(-1000)
+#define CTRLQ_PENDING	(-1001)
+
+struct ctrlq_req {
+	uint8_t  bmRequestType;
+	uint8_t  bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+	uint8_t *data;		/* wLength bytes, OUT payload or IN destination */
+	int result;		/* bytes transferred or libusb error code < 0 */
+};
+
+struct ctrlq;
+
+/* Called in request order for each completed request. Returns 0 to continue,
+ * anything else stops the queue as if the request had failed. */
+typedef int ctrlq_done_f(struct ctrlq *q, struct ctrlq_req *r);
+
+struct ctrlq {
+	/* configuration */
+	libusb_device_handle *hdev;
+	unsigned depth;		/* number of requests kept in flight */
+	unsigned timeout;	/* ms per request, 0: none */
+	ctrlq_done_f *done;	/* may be NULL */
+	struct hist *lat;	/* submission to completion latency in ns */
+	FILE *ts_log;		/* per-request timestamps, see stream_log() */
+	void *priv;
+
+	/* state */
+	struct libusb_transfer **tfers;
+	struct ctrlq_slot {
+		struct ctrlq *q;
+		struct ctrlq_req *r;
+		uint64_t t_submit;
+		size_t cap;	/* bytes allocated for the transfer buffer */
+	} *slots;
+	struct libusb_transfer **free;
+	unsigned n_free;
+	unsigned in_flight;
+	int stop;
+	int completed;		/* set by each completion, see ctrlq_run() */
+
+	/* statistics */
+	size_t n_done;		/* requests delivered in order w/o failure */
+	int result;		/* of the request that failed, if it did */
+	uint64_t t_start, t_end;	/* ns, see mono_ns() */
+};
+
+#define CTRLQ_INIT(hdev_,depth_,timeout_) \
+	{ .hdev = (hdev_), .depth = (depth_), .timeout = (timeout_), }
+
+int ctrlq_init(struct ctrlq *q);
+void ctrlq_fini(struct ctrlq *q);
+
+/* Runs the n requests in order keeping up to q->depth of them in flight on
+ * endpoint 0. Stops submitting on the first failed request (or when q->done
+ * says so) and cancels the ones already in flight; requests never run are
+ * left at CTRLQ_SKIPPED. Returns 0 if all requests succeeded, 5 if one
+ * failed (its index is q->n_done) and 6 on event handling errors. */
+int ctrlq_run(
+	libusb_context *ctx, struct ctrlq *q, struct ctrlq_req *reqs, size_t n
+);
+
+#endif
@@ -0,0 +1,272 @@
+
+#define _POSIX_C_SOURCE		200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "common.h"
+#include "fleet.h"
+#include "fw.h"
+#include "fwcache.h"
+#include "load.h"
+#include "trace.h"
+
+struct fleet_img {
+	char *path;
+	unsigned fmt;
+	struct record *recs;
+	uint64_t bytes;
+};
+
+struct fleet_dev {
+	char *sel;		/* device selector */
+	unsigned img;		/* index into fleet.imgs */
+	const char *type;
+	const char *what;	/* failed step, NULL on success */
+	uint64_t t_setup, t_load;	/* ns */
+};
+
+struct fleet {
+	const struct fleet_opts *o;
+	struct fleet_img *imgs;
+	struct fleet_dev *devs;
+	unsigned n_imgs, n_devs, cap;
+	unsigned next;		/* next device to program */
+	pthread_mutex_t lock;
+};
+
+static unsigned fleet_img_get(struct fleet *f, const char *path, unsigned fmt)
+{
+	unsigned i;
+
+	for (i=0; i<f->n_imgs; i++)
+		if (f->imgs[i].fmt == fmt && !strcmp(f->imgs[i].path, path))
+			return i;
+	f->imgs[i] = (struct fleet_img){ .path = strdup(path), .fmt = fmt, };
+	return f->n_imgs++;
+}
+
+static int fleet_parse(struct fleet *f, FILE *in)
+{
+	char *line = NULL, *sel, *path, *sfmt, *save;
+	size_t sz = 0;
+	unsigned lineno = 0, i, fmt;
+	int r = 0;
+
+	while (getline(&line, &sz, in) > 0) {
+		lineno++;
+		sel = strtok_r(line, " \t\r\n", &save);
+		if (!sel || *sel == '#')
+			continue;
+		path = strtok_r(NULL, " \t\r\n", &save);
+		sfmt = strtok_r(NULL, " \t\r\n", &save);
+		if (!path || strtok_r(NULL, " \t\r\n", &save)) {
+			fprintf(stderr, "manifest line %u: expected <device> "
+				"<image> [<format>]\n", lineno);
+			r = 1;
+			break;
+		}
+		fmt = f->o->in_fmt;
+		if (sfmt) {
+			for (fmt=0; fmt<N_IN_FMTS; fmt++)
+				if (!strcmp(sfmt, in_fmts[fmt].name))
+					break;
+			if (fmt == N_IN_FMTS) {
+				fprintf(stderr, "manifest line %u: unknown "
+					"input format: %s\n", lineno, sfmt);
+				r = 1;
+				break;
+			}
+		}
+		for (i=0; i<f->n_devs; i++)
+			if (!strcmp(f->devs[i].sel, sel))
+				break;
+		if (i < f->n_devs) {
+			fprintf(stderr, "manifest line %u: device %s listed "
+				"twice\n", lineno, sel);
+			r = 1;
+			break;
+		}
+		if (f->n_devs == f->cap) {
+			/* there are at most as many images as devices */
+			unsigned cap = f->cap ? 2 * f->cap : 16;
+			struct fleet_dev *devs;
+			struct fleet_img *imgs;
+			if ((devs = realloc(f->devs, cap * sizeof(*devs))))
+				f->devs = devs;
+			if ((imgs = realloc(f->imgs, cap * sizeof(*imgs))))
+				f->imgs = imgs;
+			if (!devs || !imgs) {
+				fprintf(stderr, "error allocating manifest\n");
+				r = 2;
+				break;
+			}
+			f->cap = cap;
+		}
+		f->devs[f->n_devs++] = (struct fleet_dev){
+			.sel = strdup(sel),
+			.img = fleet_img_get(f, path, fmt),
+			.type = "unknown",
+			.what = "not run",
+		};
+	}
+	free(line);
+	return r;
+}
+
+/* parses each distinct image once, before any device is touched */
+static int fleet_read_images(struct fleet *f)
+{
+	struct fleet_img *img;
+	struct record *rec;
+	unsigned i;
+
+	for (i=0; i<f->n_imgs; i++) {
+		img = &f->imgs[i];
+		if (!(img->recs = fw_cache_read(img->path, img->fmt, f->o->sort,
+		                                f->o->merge))) {
+			fprintf(stderr, "error reading image %s\n", img->path);
+			return 1;
+		}
+		for (rec = img->recs; rec; rec = rec->next)
+			img->bytes += rec->size;
+	}
+	return 0;
+}
+
+static void fleet_program(struct fleet *f, struct fleet_dev *d)
+{
+	const struct fleet_opts *o = f->o;
+	struct usb_common uc = USB_COMMON_INIT(o->dev_types,o->n_dev_types,-2,-2);
+	struct load_profile p = { o->chunk, o->timeout, };
+	struct ctrlq cq;
+	uint64_t t0 = mono_ns();
+
+	if (usb_common_parse_spec(&uc.spec, d->sel)) {
+		d->what = "selector";
+		return;
+	}
+	if (usb_common_setup(&uc)) {
+		d->what = "setup";
+		return;
+	}
+	if (uc.spec.dev_type)
+		d->type = uc.spec.dev_type->name;
+	d->t_setup = mono_ns() - t0;
+
+	t0 = mono_ns();
+	load_profile_get(&p, uc.spec.dev_type, uc.dev);
+	cq = (struct ctrlq)CTRLQ_INIT(uc.hdev, o->depth, p.timeout);
+	if (ctrlq_init(&cq))
+		d->what = "alloc";
+	else if (usb_load_firmware(uc.ctx, &cq, uc.spec.dev_type &&
+	                           uc.spec.dev_type == o->fx2, p.chunk,
+	                           f->imgs[d->img].recs))
+		d->what = "upload";
+	else
+		d->what = NULL;
+	d->t_load = mono_ns() - t0;
+	trace_end("fleet", "program", t0, "\"device\":\"%s\",\"ok\":%s",
+	          d->sel, d->what ? "false" : "true");
+	ctrlq_fini(&cq);
+	usb_common_teardown(&uc);
+}
+
+static void * fleet_worker(void *arg)
+{
+	struct fleet *f = arg;
+	unsigned i;
+
+	while (1) {
+		pthread_mutex_lock(&f->lock);
+		i = f->next < f->n_devs ? f->next++ : f->n_devs;
+		pthread_mutex_unlock(&f->lock);
+		if (i == f->n_devs)
+			break;
+		fleet_program(f, &f->devs[i]);
+	}
+	return NULL;
+}
+
+static unsigned fleet_report(const struct fleet *f, uint64_t dt, FILE *out)
+{
+	const struct fleet_dev *d;
+	const struct fleet_img *img;
+	unsigned i, failed = 0;
+
+	fprintf(out, "%-12s %-7s %-24s %-8s %10s %10s %10s\n", "device", "type",
+		"image", "result", "setup[ms]", "load[ms]", "KB/s");
+	for (i=0; i<f->n_devs; i++) {
+		d = &f->devs[i];
+		img = &f->imgs[d->img];
+		fprintf(out, "%-12s %-7s %-24s %-8s %10.1f %10.1f %10.1f\n",
+			d->sel, d->type, img->path, d->what ? d->what : "ok",
+			d->t_setup * 1e-6, d->t_load * 1e-6,
+			!d->what && d->t_load ? img->bytes * 1e6 / d->t_load
+			                      : 0.0);
+		failed += d->what != NULL;
+	}
+	fprintf(out, "%u devices, %u failed, %u images, in %.3f s\n",
+		f->n_devs, failed, f->n_imgs, dt * 1e-9);
+	return failed;
+}
+
+int fleet_run(const char *manifest, const struct fleet_opts *o)
+{
+	struct fleet f = { .o = o, };
+	pthread_t *threads = NULL;
+	unsigned i, n_threads = 0;
+	uint64_t t0;
+	FILE *in;
+	int r;
+
+	in = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+	if (!in) {
+		perror(manifest);
+		return 1;
+	}
+	r = fleet_parse(&f, in);
+	if (in != stdin)
+		fclose(in);
+	if (!r && !f.n_devs) {
+		fprintf(stderr, "no devices in manifest %s\n", manifest);
+		r = 1;
+	}
+	if (r || (r = fleet_read_images(&f)))
+		goto out;
+
+	/* the records are only read from here on */
+	load_verbose = 0;
+	pthread_mutex_init(&f.lock, NULL);
+	threads = calloc(o->workers, sizeof(*threads));
+	t0 = mono_ns();
+	for (i=0; threads && i<o->workers && i<f.n_devs; i++, n_threads++)
+		if ((r = pthread_create(&threads[i], NULL, fleet_worker, &f))) {
+			fprintf(stderr, "error starting worker: %s\n",
+				strerror(r));
+			break;
+		}
+	if (!n_threads)
+		/* no workers, do it ourselves */
+		fleet_worker(&f);
+	for (i=0; i<n_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&f.lock);
+
+	r = fleet_report(&f, mono_ns() - t0, stdout) ? 3 : 0;
+
+out:
+	for (i=0; i<f.n_devs; i++)
+		free(f.devs[i].sel);
+	for (i=0; i<f.n_imgs; i++) {
+		free(f.imgs[i].path);
+		record_free_all(f.imgs[i].recs);
+	}
+	free(f.devs);
+	free(f.imgs);
+	free(threads);
+	return r;
+}
@@ -0,0 +1,27 @@
+
+#ifndef FLEET_H
+#define FLEET_H
+
+#include "usb.h"
+
+#define DEFAULT_FLEET_WORKERS	4
+
+struct fleet_opts {
+	unsigned in_fmt;	/* default input format, see in_fmts */
+	int sort, merge;
+	unsigned workers;	/* devices programmed concurrently */
+	unsigned depth;		/* control requests in flight per device */
+	unsigned timeout;	/* ms per request, 0: from the profile */
+	unsigned chunk;		/* bytes per request, 0: from the profile */
+	const struct dev_type *dev_types;
+	unsigned n_dev_types;
+	const struct dev_type *fx2;	/* type whose CPU is held in reset */
+};
+
+/* Programs all devices listed in manifest, one per line:
+ *   {<bus>.<addr> | <vid>:<pid>} <image> [<format>]
+ * Each distinct image is parsed once. Prints a result table to stdout and
+ * returns 0 if all devices succeeded. */
+int fleet_run(const char *manifest, const struct fleet_opts *o);
+
+#endif
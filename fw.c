@@ -0,0 +1,721 @@
+
+#define _POSIX_C_SOURCE		200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h> /* offsetof() */
+#include <sys/stat.h> /* fstat() */
+#include <sys/mman.h> /* mmap() */
+
+#include "fw.h"
+#include "trace.h"
+
+struct record * record_create(uint32_t addr, uint32_t size)
+{
+	struct record *r = malloc(offsetof(struct record, data) + size);
+	if (!r)
+		return NULL;
+	r->next = NULL;
+	r->block = NULL;
+	r->addr = addr;
+	r->size = size;
+	return r;
+}
+
+static struct record * record_read_ihex(FILE *f);
+static struct record * record_read_cyfw(FILE *f);
+static struct record * record_read_bin(FILE *f);
+
+static int record_write_bin(FILE *f, const struct record *r,
+                            const struct fw_out *o);
+static int record_write_ihex(FILE *f, const struct record *r,
+                             const struct fw_out *o);
+static int record_write_cyfw(FILE *f, const struct record *r,
+                             const struct fw_out *o);
+
+/* support tables */
+const struct in_fmt in_fmts[N_IN_FMTS] = {
+	[IN_FMT_IHEX] = { "ihex", record_read_ihex, },
+	[IN_FMT_CYFW] = { "cyfw", record_read_cyfw, },
+	[IN_FMT_BIN ] = { "bin", record_read_bin, }
+};
+
+const struct dump_fmt dump_fmts[N_DUMP_FMTS] = {
+	[DUMP_FMT_BIN ] = { "bin", record_write_bin, },
+	[DUMP_FMT_IHEX] = { "ihex", record_write_ihex, },
+	[DUMP_FMT_CYFW] = { "cyfw", record_write_cyfw, },
+};
+
+/* firmware input helper functions */
+
+/* allocates a block for len bytes of records */
+static struct record_block * record_block_alloc(size_t len)
+{
+	struct record_block *b = malloc(sizeof(*b) + len);
+	if (b)
+		*b = (struct record_block){ NULL, 0, };
+	return b;
+}
+
+/* Two passes: the first sizes the runs of adjacent records, the second copies
+ * each byte once into a single block holding the whole coalesced list. */
+struct record * record_merge_adj(struct record *head)
+{
+	struct record *run, *r, *next, *m, *ret = NULL, **tail = &ret;
+	uint64_t t0 = trace_begin();
+	size_t total = 0;
+	struct record_block *b;
+	uint32_t size;
+	uint8_t *at;
+	int merge = 0;
+
+	for (run = head; run; run = next) {
+		size = run->size;
+		for (r = run; (next = r->next) && r->addr + r->size == next->addr;
+		     r = next, merge = 1)
+			size += next->size;
+		total += record_span(size);
+	}
+	if (!merge)
+		goto done;
+	if (!(b = record_block_alloc(total))) {
+		fprintf(stderr, "warning: not merging records: %s\n",
+			strerror(errno));
+		goto done;
+	}
+
+	at = (uint8_t *)record_block_first(b);
+	for (run = head; run; run = next) {
+		m = (struct record *)at;
+		m->next = NULL;
+		m->block = b;
+		m->addr = run->addr;
+		m->size = 0;
+		for (r = run; r; r = next) {
+			memcpy(m->data + m->size, r->data, r->size);
+			m->size += r->size;
+			next = r->next;
+			if (!next || r->addr + r->size != next->addr)
+				break;
+		}
+		*tail = m;
+		tail = &m->next;
+		at += record_span(m->size);
+	}
+	record_free_all(head);
+	head = ret;
+
+done:
+	trace_end("image", "merge", t0, NULL);
+	return head;
+}
+
+void record_free_all(struct record *head)
+{
+	struct record *next, *firsts = NULL;
+	struct record_block *b;
+
+	/* blocks are released last, the list may still continue inside of
+	 * them */
+	for (; head; head = next) {
+		next = head->next;
+		if (!head->block) {
+			free(head);
+		} else if (head == record_block_first(head->block)) {
+			head->next = firsts;
+			firsts = head;
+		}
+	}
+	for (; firsts; firsts = next) {
+		next = firsts->next;
+		b = firsts->block;
+		if (b->map)
+			munmap(b->map, b->len);
+		else
+			free(b);
+	}
+}
+
+/* lexicograph. ordering: 1.addr, 2.size, enables size 0 entries to be merged */
+struct record_key {
+	uint64_t key;		/* addr << 32 | size */
+	struct record *r;
+};
+
+/* Stable LSD radix sort of k[0,n), n > 0, a byte at a time, skipping the bytes
+ * all keys share (e.g. the sizes of typical ihex records). Returns k or tmp,
+ * whichever ends up holding the result. */
+static struct record_key * record_keys_sort(struct record_key *k,
+                                            struct record_key *tmp, size_t n)
+{
+	size_t count[8][256] = {{ 0 }}, i, c, sum;
+	struct record_key *t;
+	unsigned d;
+
+	for (i=0; i<n; i++)
+		for (d=0; d<8; d++)
+			count[d][k[i].key >> 8*d & 0xff]++;
+	for (d=0; d<8; d++) {
+		if (count[d][k[0].key >> 8*d & 0xff] == n)
+			continue;
+		for (i=0, sum=0; i<256; i++) {
+			c = count[d][i];
+			count[d][i] = sum;
+			sum += c;
+		}
+		for (i=0; i<n; i++)
+			tmp[count[d][k[i].key >> 8*d & 0xff]++] = k[i];
+		t = k;
+		k = tmp;
+		tmp = t;
+	}
+	return k;
+}
+
+/* Sorts keys gathered in one pass over the list in linear time, keeping the
+ * work within one array instead of chasing records all over the heap.
+ * Relinking the records in order also counts those overlapping preceding
+ * ones. */
+struct record * record_sort(struct record *head)
+{
+	struct record *p, *ret = NULL, **tail = &ret;
+	struct record_key *keys, *k;
+	size_t i, n = 0;
+	uint64_t t0 = trace_begin(), end = 0, n_overlap = 0;
+	uint32_t addr, size;
+
+	for (p = head; p; p = p->next)
+		n++;
+	if (!n)
+		return head;
+	if (!(keys = malloc(2 * n * sizeof(*keys)))) {
+		fprintf(stderr, "warning: not sorting records: %s\n",
+			strerror(errno));
+		return head;
+	}
+	for (p = head, i = 0; p; p = p->next, i++)
+		keys[i] = (struct record_key){ (uint64_t)p->addr << 32 | p->size, p, };
+	k = record_keys_sort(keys, keys + n, n);
+	for (i=0; i<n; i++) {
+		*tail = k[i].r;
+		tail = &k[i].r->next;
+		addr = k[i].key >> 32;
+		size = k[i].key;
+		if (!size)
+			continue;
+		if (addr < end)
+			n_overlap++;
+		if (addr + (uint64_t)size > end)
+			end = addr + (uint64_t)size;
+	}
+	*tail = NULL;
+	free(keys);
+
+	if (n_overlap)
+		fprintf(stderr, "warning: %" PRIu64 " records overlap preceding "
+			"ones, the data uploaded last wins\n", n_overlap);
+
+	trace_end("image", "sort", t0, NULL);
+	return ret;
+}
+
+/* read ihex */
+
+/* hex digit value | 0x10, 0 for any other character */
+#define D(c,v)	[c] = 0x10 | (v)
+static const uint8_t ihex_digit[256] = {
+	D('0', 0), D('1', 1), D('2', 2), D('3', 3), D('4', 4),
+	D('5', 5), D('6', 6), D('7', 7), D('8', 8), D('9', 9),
+	D('A',10), D('B',11), D('C',12), D('D',13), D('E',14), D('F',15),
+	D('a',10), D('b',11), D('c',12), D('d',13), D('e',14), D('f',15),
+};
+#undef D
+
+/* decodes the byte at s, clearing bit 4 of *ok unless both digits are valid */
+static inline uint8_t ihex_byte(const char *s, uint8_t *ok)
+{
+	uint8_t hi = ihex_digit[(uint8_t)s[0]], lo = ihex_digit[(uint8_t)s[1]];
+	*ok &= hi & lo;
+	return hi << 4 | (lo & 0x0f);
+}
+
+static uint32_t ihex_be(const uint8_t *v, unsigned n)
+{
+	uint32_t r = 0;
+	while (n--)
+		r = r << 8 | *v++;
+	return r;
+}
+
+/* Parses the whole file at buf in one pass, placing the records back to back
+ * into a single block sized for the worst case. Extended segment (02) and
+ * linear (04) address records set the base of the following data records,
+ * start address records (03, 05) become a record of size 0 at the entry
+ * point, as in cyfw images. Segment offsets do not wrap around. */
+static struct record * ihex_parse(const char *buf, size_t len)
+{
+	const char *p, *end = buf + len, *eol, *s;
+	struct record *r, *head = NULL, **tail = &head;
+	struct record_block *b;
+	uint8_t *at, v[4], ok, crc, ref, type;
+	size_t n = 0;
+	uint32_t base = 0, addr, size, j;
+	unsigned line;
+
+	for (p = buf; (p = memchr(p, ':', end - p)); p++)
+		n++;
+	if (!(b = record_block_alloc(n * (record_span(0) + _Alignof(struct record))
+	                             + len / 2))) {
+		perror("ihex");
+		return NULL;
+	}
+	at = (uint8_t *)record_block_first(b);
+
+	for (p = buf, line = 1; p < end; p = eol + 1, line++) {
+		if (!(eol = memchr(p, '\n', end - p)))
+			eol = end;
+		if (eol - p < 11) {
+			fprintf(stderr, "warning: "
+				"skipping invalid line %u: too short\n",
+				line);
+			continue;
+		}
+		if (p[0] != ':') {
+			fprintf(stderr, "warning: skipping invalid line %u\n",
+				line);
+			continue;
+		}
+		ok = 0x10;
+		size = ihex_byte(p + 1, &ok);
+		addr = ihex_byte(p + 3, &ok) << 8;
+		addr |= ihex_byte(p + 5, &ok);
+		type = ihex_byte(p + 7, &ok);
+		if (!ok)
+			goto invalid;
+		if (size > (uint32_t)(eol - p - 11) / 2) {
+			fprintf(stderr,
+				"ihex contains invalid line %u: size (%u) > "
+				"data length (%td)\n",
+				line, size, (eol - p - 11) / 2);
+			goto fail;
+		}
+		crc = size + (addr >> 8) + addr + type;
+
+		r = (struct record *)at;
+		s = p + 9;
+		if (type) {
+			/* address records, decoded into v */
+			for (j=0; j<size; j++, s += 2) {
+				ref = ihex_byte(s, &ok);
+				crc += ref;
+				if (j < sizeof(v))
+					v[j] = ref;
+			}
+		} else {
+			r->next = NULL;
+			r->block = b;
+			r->addr = base + addr;
+			r->size = size;
+			for (j=0; j<size; j++, s += 2)
+				crc += r->data[j] = ihex_byte(s, &ok);
+		}
+		ref = ihex_byte(s, &ok);
+		if (!ok)
+			goto invalid;
+		if ((crc += ref)) {
+			fprintf(stderr,
+				"CRC failure on line %u: expected 0x%02hhx, "
+				"got: 0x%02x\n",
+				line, ref, (crc - ref) & 0xff);
+			goto fail;
+		}
+
+		switch (type) {
+		case 0x00: /* data */
+			break;
+		case 0x01: /* EOF */
+			if (!head)
+				free(b);
+			return head;
+		case 0x02: /* extended segment address */
+		case 0x04: /* extended linear address */
+			if (size != 2)
+				goto bad_size;
+			base = ihex_be(v, 2) << (type == 0x02 ? 4 : 16);
+			continue;
+		case 0x03: /* start segment address, CS:IP */
+		case 0x05: /* start linear address */
+			if (size != 4)
+				goto bad_size;
+			r->next = NULL;
+			r->block = b;
+			r->addr = type == 0x03
+			        ? (ihex_be(v, 2) << 4) + ihex_be(v + 2, 2)
+			        : ihex_be(v, 4);
+			r->size = 0;
+			break;
+		default:
+			fprintf(stderr,
+				"unsupported record type 0x%02hhx on line %u\n",
+				type, line);
+			goto fail;
+		}
+		*tail = r;
+		tail = &r->next;
+		at += record_span(r->size);
+	}
+	fprintf(stderr, "ihex ends without EOF record\n");
+	goto fail;
+
+invalid:
+	for (s = p + 1; ihex_digit[(uint8_t)*s]; s++);
+	fprintf(stderr, "ihex contains invalid data on line %u: '%c'\n",
+		line, *s);
+	goto fail;
+bad_size:
+	fprintf(stderr, "invalid size %u of record type 0x%02hhx on line %u\n",
+		size, type, line);
+fail:
+	free(b);
+	return NULL;
+}
+
+/* maps the file if possible, otherwise reads it into memory */
+static struct record * record_read_ihex(FILE *f)
+{
+	struct record *r = NULL;
+	struct stat st;
+	char *buf = NULL, *tmp;
+	size_t len = 0, cap = 0, n;
+	int fd = fileno(f);
+
+	if (fd != -1 && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size &&
+	    (buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	    != MAP_FAILED) {
+		r = ihex_parse(buf, st.st_size);
+		munmap(buf, st.st_size);
+		return r;
+	}
+
+	for (buf = NULL; ; len += n) {
+		if (len == cap) {
+			cap = cap ? 2 * cap : 1 << 16;
+			if (!(tmp = realloc(buf, cap))) {
+				perror("reading input file");
+				goto out;
+			}
+			buf = tmp;
+		}
+		if (!(n = fread(buf + len, 1, cap - len, f)))
+			break;
+	}
+	if (ferror(f))
+		perror("reading input file");
+	else
+		r = ihex_parse(buf, len);
+out:
+	free(buf);
+	return r;
+}
+
+/* read cyfw */
+
+static uint32_t le32toh(const uint8_t *v)
+{
+	uint32_t r;
+	r  = v[0];
+	r |= v[1] <<  8;
+	r |= v[2] << 16;
+	r |= v[3] << 24;
+	return r;
+}
+
+static struct record * record_read_cyfw(FILE *f)
+{
+	struct record *r, *head = NULL, **tail = &head;
+	uint32_t i, size, addr, crc = 0, crc_ref;
+	uint8_t v[8];
+	uint8_t bImageCTL, bImageType;
+	int u;
+
+	if (getc(f) != 'C' || getc(f) != 'Y') {
+		fprintf(stderr, "input does not begin with magic 'CY'\n");
+		return NULL;
+	}
+
+	if ((u = getc(f)) == EOF)
+		goto eof;
+	// fw->i2c_conf = u;
+	if ((u = getc(f)) == EOF)
+		goto eof;
+	// fw->img_type = u;
+
+	while (1) {
+		if (!fread(v, 8, 1, f))
+			goto eof;
+		size = le32toh(v);
+		addr = le32toh(v + 4);
+		if (addr & 0x03)
+			fprintf(stderr,
+				"warning: address 0x%08x is not 32-bit "
+				"aligned\n", addr);
+		r = record_create(addr, size * 4);
+		*tail = r;
+		tail = &r->next;
+		if (!size)
+			break;
+		if (!fread(r->data, size * 4, 1, f))
+			goto eof;
+		for (i=0; i<size; i++)
+			crc += le32toh(r->data + 4 * i);
+	}
+	if (!fread(v, 4, 1, f))
+		goto eof;
+	crc_ref = le32toh(v); /* checksum */
+	if (crc != crc_ref) {
+		fprintf(stderr,
+			"checksum failure: expected %08x, got %08x\n",
+			crc_ref, crc);
+		goto fail;
+	}
+	if (getc(f) != EOF)
+		fprintf(stderr,
+			"warning: ignoring garbage at the end of firmware data "
+			"at input position %ld\n", ftell(f) - 1);
+	return head;
+
+eof:
+	if (feof(f))
+		fprintf(stderr, "premature EOF while reading input\n");
+	else
+		fprintf(stderr, "error reading input: %s\n",
+			strerror(ferror(f)));
+fail:
+	while (head) {
+		r = head->next;
+		free(head);
+		head = r;
+	}
+	return NULL;
+}
+
+static struct record * record_read_bin(FILE *f)
+{
+	struct stat st;
+	int fd;
+	struct record *r;
+
+	fd = fileno(f);
+	if (fd == -1) {
+		perror("invalid input file handle");
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		perror("stat");
+		return NULL;
+	}
+
+	r = record_create(0, st.st_size);
+	if (!fread(r->data, st.st_size, 1, f)) {
+		perror("reading input file");
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+/* write bin: the data from the first record's address on, gaps zeroed;
+ * entry points (records of size 0) have no place in it */
+static int record_write_bin(FILE *f, const struct record *r,
+                            const struct fw_out *o)
+{
+	uint64_t at;
+
+	while (r && !r->size)
+		r = r->next;
+	at = r ? r->addr : 0;
+	for (; r; r = r->next) {
+		if (!r->size)
+			continue;
+		if (r->addr < at) {
+			fprintf(stderr, "bin output needs ascending, "
+				"non-overlapping records, sort them (-s)\n");
+			return 1;
+		}
+		for (; at < r->addr; at++)
+			putc(0, f);
+		if (!fwrite(r->data, r->size, 1, f))
+			break;
+		at += r->size;
+	}
+	return ferror(f);
+}
+
+/* write ihex */
+
+#define IHEX_LINE		16 /* data bytes per line written */
+
+static char * ihex_put(char *p, uint8_t b)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	*p++ = digits[b >> 4];
+	*p++ = digits[b & 0x0f];
+	return p;
+}
+
+static void ihex_line(FILE *f, uint8_t type, uint16_t addr,
+                      const uint8_t *data, unsigned len)
+{
+	char buf[1 + 2 * (4 + IHEX_LINE + 1) + 1], *p = buf;
+	uint8_t crc = len + (addr >> 8) + addr + type;
+	unsigned i;
+
+	*p++ = ':';
+	p = ihex_put(p, len);
+	p = ihex_put(p, addr >> 8);
+	p = ihex_put(p, addr);
+	p = ihex_put(p, type);
+	for (i=0; i<len; i++) {
+		p = ihex_put(p, data[i]);
+		crc += data[i];
+	}
+	p = ihex_put(p, -crc);
+	*p++ = '\n';
+	fwrite(buf, p - buf, 1, f);
+}
+
+/* extended linear address records precede data beyond 64 KB, a start
+ * linear address record gives the entry point */
+static int record_write_ihex(FILE *f, const struct record *r,
+                             const struct fw_out *o)
+{
+	uint32_t upper = 0, addr, i, n;
+
+	for (; r; r = r->next)
+		for (i=0; i<r->size; i+=n) {
+			addr = r->addr + i;
+			if (addr >> 16 != upper) {
+				upper = addr >> 16;
+				ihex_line(f, 0x04, 0, (uint8_t[]){
+					upper >> 8, upper,
+				}, 2);
+			}
+			n = r->size - i;
+			if (n > IHEX_LINE)
+				n = IHEX_LINE;
+			if (n > 0x10000 - (addr & 0xffff))
+				n = 0x10000 - (addr & 0xffff);
+			ihex_line(f, 0x00, addr, r->data + i, n);
+		}
+	if (o->entry >= 0)
+		ihex_line(f, 0x05, 0, (uint8_t[]){
+			o->entry >> 24, o->entry >> 16, o->entry >> 8, o->entry,
+		}, 4);
+	ihex_line(f, 0x01, 0, NULL, 0);
+	return ferror(f);
+}
+
+/* write cyfw */
+
+static void htole32(uint8_t *v, uint32_t x)
+{
+	v[0] = x;
+	v[1] = x >>  8;
+	v[2] = x >> 16;
+	v[3] = x >> 24;
+}
+
+/* records of size 0 are skipped, the others padded to whole words */
+static int record_write_cyfw(FILE *f, const struct record *r,
+                             const struct fw_out *o)
+{
+	uint32_t i, crc = 0;
+	uint8_t v[8];
+
+	if (o->entry < 0) {
+		fprintf(stderr, "cyfw output needs a program entry point\n");
+		return 1;
+	}
+	v[0] = 'C';
+	v[1] = 'Y';
+	v[2] = o->i2c_conf;
+	v[3] = o->img_type;
+	fwrite(v, 4, 1, f);
+
+	for (; r; r = r->next) {
+		if (!r->size)
+			continue;
+		if (r->addr & 0x03)
+			fprintf(stderr,
+				"warning: address 0x%08x is not 32-bit "
+				"aligned\n", r->addr);
+		if (r->size & 0x03)
+			fprintf(stderr, "warning: padding record at 0x%08x to "
+				"whole 32-bit words\n", r->addr);
+		htole32(v, (r->size + 3) / 4);
+		htole32(v + 4, r->addr);
+		fwrite(v, 8, 1, f);
+		fwrite(r->data, r->size, 1, f);
+		for (i=0; i+4<=r->size; i+=4)
+			crc += le32toh(r->data + i);
+		if (i < r->size) {
+			memset(v, 0, 4);
+			memcpy(v, r->data + i, r->size - i);
+			crc += le32toh(v);
+			fwrite(v + (r->size - i), 4 - (r->size - i), 1, f);
+		}
+	}
+	htole32(v, 0);
+	htole32(v + 4, o->entry);
+	fwrite(v, 8, 1, f);
+	htole32(v, crc);
+	fwrite(v, 4, 1, f);
+	return ferror(f);
+}
+
+/* reads firmware file path in format in_fmts[fmt] */
+struct record * fw_read(const char *path, unsigned fmt)
+{
+	struct record *recs, *r;
+	uint64_t t0 = trace_begin(), n = 0, bytes = 0;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	recs = in_fmts[fmt].read(f);
+	fclose(f);
+	if (trace_file) {
+		for (r = recs; r; r = r->next, n++)
+			bytes += r->size;
+		trace_end("image", "parse", t0, "\"format\":\"%s\","
+		          "\"records\":%" PRIu64 ",\"bytes\":%" PRIu64,
+		          in_fmts[fmt].name, n, bytes);
+	}
+	return recs;
+}
+
+int fw_write(const char *path, unsigned fmt, const struct record *recs,
+             const struct fw_out *o)
+{
+	uint64_t t0 = trace_begin();
+	FILE *f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	int r;
+
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	r = dump_fmts[fmt].write(f, recs, o);
+	if (f == stdout ? fflush(f) : fclose(f))
+		r = 1;
+	if (r)
+		fprintf(stderr, "error writing %s image to %s\n",
+			dump_fmts[fmt].name, path);
+	trace_end("image", "write", t0, "\"format\":\"%s\"",
+	          dump_fmts[fmt].name);
+	return r;
+}
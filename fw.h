@@ -0,0 +1,75 @@
+
+#ifndef FW_H
+#define FW_H
+
+#include <stdio.h>
+#include <stddef.h> /* offsetof() */
+#include <inttypes.h>
+
+/* firmware data types */
+struct record {
+	struct record *next;
+	struct record_block *block;	/* NULL: allocated alone */
+	uint32_t addr;
+	uint32_t size;
+	uint8_t data[];
+};
+
+/* header of records placed back to back in one allocation or mapping,
+ * released by record_free_all() along with the first of them */
+struct record_block {
+	void *map;		/* start of the mapping, NULL: from malloc() */
+	size_t len;		/* of the mapping */
+};
+
+/* bytes taken by a record in a block, keeping the next one aligned */
+static inline size_t record_span(uint32_t size)
+{
+	size_t n = offsetof(struct record, data) + size;
+	return (n + _Alignof(struct record) - 1) & ~(_Alignof(struct record) - 1);
+}
+
+static inline struct record * record_block_first(struct record_block *b)
+{
+	return (struct record *)(b + 1);
+}
+
+enum { IN_FMT_IHEX, IN_FMT_CYFW, IN_FMT_BIN, N_IN_FMTS };
+enum { DUMP_FMT_BIN, DUMP_FMT_IHEX, DUMP_FMT_CYFW, N_DUMP_FMTS };
+
+/* settings of written images */
+struct fw_out {
+	uint8_t i2c_conf;	/* cyfw configuration bytes */
+	uint8_t img_type;
+	int64_t entry;		/* program entry point, < 0: none */
+};
+
+struct in_fmt {
+	const char *name;
+	struct record * (*read)(FILE *f);
+};
+
+struct dump_fmt {
+	const char *name;
+	/* writes the records to f as they are iterated, returns 0 on success */
+	int (*write)(FILE *f, const struct record *recs, const struct fw_out *o);
+};
+
+/* support tables */
+extern const struct in_fmt in_fmts[N_IN_FMTS];
+extern const struct dump_fmt dump_fmts[N_DUMP_FMTS];
+
+struct record * record_create(uint32_t addr, uint32_t size);
+void record_free_all(struct record *head);
+
+/* coalesces adjacent records into one block holding the whole list */
+struct record * record_merge_adj(struct record *head);
+/* stable, ordered by address, then size */
+struct record * record_sort(struct record *head);
+
+struct record * fw_read(const char *path, unsigned fmt);
+/* writes recs to path ("-": stdout) in format dump_fmts[fmt] */
+int fw_write(const char *path, unsigned fmt, const struct record *recs,
+             const struct fw_out *o);
+
+#endif
@@ -0,0 +1,367 @@
+
+#define _POSIX_C_SOURCE		200809L	/* getopt(), optind, clock_gettime() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>		/* offsetof() */
+#include <unistd.h>		/* getopt(), optind */
+#include <setjmp.h>
+
+#include "common.h"
+#include "fw.h"
+
+/* Compares the ihex reader, record_sort() and record_merge_adj() with the
+ * implementations they replaced, on synthetic images of contiguous records:
+ * the ihex files list them in address order, the images to be sorted in
+ * random order. */
+
+#define USAGE(ret,progname)	FATAL(ret,"\
+usage: %s [-n <max_records>] [-o <max_records>] [-s <size>] [-g <every>]\n\
+\n\
+Times parsing, sorting and merging images of 10^3 up to <max_records>\n\
+(default 10^6) records of <size> bytes (default 16, at most 255 for ihex).\n\
+\n\
+  -o <max_records> largest image sorted and merged with the old\n\
+                   implementation, too (default 10^5, it is quadratic)\n\
+  -g <every>       leave a gap after every <every>-th record, giving as many\n\
+                   merged records (default: 0, merge into one)\n\
+",progname)
+
+/* the previous implementations, kept for reference */
+
+static struct record * old_merge_adj(struct record *head)
+{
+	struct record hd = { .next = head, };
+	struct record *prev = &hd, *cur, *next;
+
+	while ((cur = prev->next) != NULL && (next = cur->next) != NULL) {
+		if (cur->addr + cur->size != next->addr) {
+			prev = cur;
+			continue;
+		}
+		cur = realloc(cur, offsetof(struct record, data) + cur->size + next->size);
+		prev->next = cur;
+		cur->next = next->next;
+		memcpy(cur->data + cur->size, next->data, next->size);
+		cur->size += next->size;
+		free(next);
+	}
+	return hd.next;
+}
+
+static jmp_buf ihex_jmp_buf;
+
+static uint8_t nibble(char c)
+{
+	if ('0' <= c && c <= '9') return c - '0';
+	if ('A' <= c && c <= 'F') return c - 'A' + 10;
+	if ('a' <= c && c <= 'f') return c - 'a' + 10;
+	longjmp(ihex_jmp_buf, 0x100 | (c & 0xff));
+}
+
+static uint8_t hex(const char *data, uint8_t *crc)
+{
+	uint8_t r = nibble(data[0]) << 4 | nibble(data[1]);
+	*crc += r;
+	return r;
+}
+
+static struct record * old_read_ihex(FILE *f)
+{
+	/* volatile: live across the setjmp() below */
+	struct record *r, *head = NULL, **volatile tail = &head;
+	char *data = NULL;
+	size_t dsize = 0;
+	ssize_t ret;
+	uint8_t crc = 0, crc_ref, type;
+	volatile unsigned line;
+	unsigned size, j;
+	int jmpr;
+
+	for (line = 1; (ret = getline(&data, &dsize, f)) > 0; line++) {
+		if (ret < 11) {
+			fprintf(stderr, "warning: "
+				"skipping invalid line %u: too short\n",
+				line);
+			continue;
+		}
+		if (data[0] != ':') {
+			fprintf(stderr, "warning: skipping invalid line %u\n",
+				line);
+			continue;
+		}
+		if ((j = strspn(data + 1, "0123456789ABCDEFabcdef")) < 8) {
+			fprintf(stderr,
+				"ihex contains invalid data on line %u: '%c'\n",
+				line, data[1+j]);
+			break;
+		}
+		size     = hex(data + 1, &crc);
+		if (size > ret - 11) {
+			fprintf(stderr,
+				"ihex contains invalid line %u: size (%u) > "
+				"data length (%zd)\n",
+				line, size, ret - 11);
+			break;
+		}
+		r        = record_create(0, size);
+		*tail    = r;
+		tail     = &r->next;
+		r->addr  = hex(data + 3, &crc) << 8;
+		r->addr |= hex(data + 5, &crc);
+		type     = hex(data + 7, &crc);
+
+		if ((jmpr = setjmp(ihex_jmp_buf))) {
+			fprintf(stderr,
+				"ihex contains invalid data on line %u: '%c'\n",
+				line, jmpr & 0xff);
+			break;
+		}
+
+		for (j=0; j<size; j++)
+			r->data[j] = hex(data + 9 + (j+j), &crc);
+
+		crc_ref = hex(data + 9 + (j+j), &crc);
+		if (crc) {
+			fprintf(stderr,
+				"CRC failure on line %u: expected 0x%02hhx, "
+				"got: 0x%02x\n",
+				line, crc_ref, (crc - crc_ref) & 0xff);
+			break;
+		}
+
+		/* ordinary record, no offsets / segmented memory supported */
+		if (!type)
+			continue;
+		/* EOF record */
+		if (type == 1)
+			goto done;
+		/* unknown record */
+		fprintf(stderr, "unsupported record type 0x%02hhx on line %u\n",
+			type, line);
+		break;
+	}
+
+	/* failure case */
+	while (head) {
+		r = head->next;
+		free(head);
+		head = r;
+	}
+
+done:
+	free(data);
+	return head;
+}
+
+static struct record * old_sort(struct record *head)
+{
+	struct record ret = { .next = NULL, };
+	struct record *prev, *it, *next;
+
+	for (; head; head = next) {
+		next = head->next;
+		for (prev = &ret; (it = prev->next) != NULL; prev = it)
+			if ((it->addr >  head->addr) ||
+			    (it->addr == head->addr && it->size > head->size))
+				break;
+		prev->next = head;
+		head->next = it;
+	}
+	return ret.next;
+}
+
+static uint8_t fill(uint32_t addr)
+{
+	return addr ^ addr >> 8 ^ addr >> 16;
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/* n records of size bytes, shuffled, each filled as per fill() */
+static struct record * image_create(size_t n, uint32_t size, size_t gap)
+{
+	struct record **v = malloc(n * sizeof(*v)), *head = NULL, *t;
+	uint64_t seed = 0x9e3779b97f4a7c15;
+	uint32_t addr = 0, j;
+	size_t i, k;
+
+	if (!v)
+		return NULL;
+	for (i=0; i<n; i++) {
+		if (!(v[i] = record_create(addr, size)))
+			FATAL(2,"out of memory\n");
+		for (j=0; j<size; j++)
+			v[i]->data[j] = fill(addr + j);
+		addr += size;
+		if (gap && (i + 1) % gap == 0)
+			addr += size;
+	}
+	for (i=n; i>1; i--) {
+		k = xorshift(&seed) % i;
+		t = v[i-1];
+		v[i-1] = v[k];
+		v[k] = t;
+	}
+	for (i=n; i; i--) {
+		v[i-1]->next = head;
+		head = v[i-1];
+	}
+	free(v);
+	return head;
+}
+
+/* returns the number of records or 0 if the result is wrong */
+static size_t image_check(const struct record *r, size_t n, uint32_t size,
+                          size_t gap)
+{
+	uint32_t addr = 0, j;
+	size_t n_recs = 0, cnt;
+
+	for (; r; r = r->next, n_recs++) {
+		cnt = gap && gap < n ? gap : n;
+		if (r->addr < addr || r->size != cnt * size)
+			return 0;
+		for (j=0; j<r->size; j++)
+			if (r->data[j] != fill(r->addr + j))
+				return 0;
+		addr = r->addr + r->size;
+		n -= cnt;
+	}
+	return n ? 0 : n_recs;
+}
+
+static int bench(const char *name, size_t n, uint32_t size, size_t gap,
+                 struct record * (*sort)(struct record *),
+                 struct record * (*merge)(struct record *))
+{
+	struct record *recs = image_create(n, size, gap);
+	uint64_t t0, t1, t2;
+	size_t n_out;
+
+	if (!recs)
+		FATAL(2,"out of memory\n");
+	t0 = mono_ns();
+	recs = sort(recs);
+	t1 = mono_ns();
+	recs = merge(recs);
+	t2 = mono_ns();
+	n_out = image_check(recs, n, size, gap);
+	printf("%9zu %4s %12.3f %12.3f %9zu%s\n", n, name, (t1 - t0) * 1e-6,
+	       (t2 - t1) * 1e-6, n_out, n_out ? "" : "  FAILED");
+	fflush(stdout);
+	record_free_all(recs);
+	return !n_out;
+}
+
+/* n data records of size bytes, 16 bit addresses wrap around */
+static FILE * ihex_create(size_t n, uint32_t size)
+{
+	FILE *f = tmpfile();
+	uint32_t addr = 0, j;
+	uint8_t crc, b;
+	size_t i;
+
+	if (!f)
+		return NULL;
+	for (i=0; i<n; i++, addr += size) {
+		crc = size + (addr >> 8 & 0xff) + (addr & 0xff);
+		fprintf(f, ":%02X%04X00", size, addr & 0xffff);
+		for (j=0; j<size; j++) {
+			crc += b = fill(addr + j);
+			fprintf(f, "%02X", b);
+		}
+		fprintf(f, "%02X\n", -crc & 0xff);
+	}
+	fprintf(f, ":00000001FF\n");
+	if (fflush(f)) {
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+/* compares the records read by both parsers, the old one (a) also returned
+ * the EOF line as a record of size 0 */
+static int ihex_same(const struct record *a, const struct record *b)
+{
+	for (; a && b; a = a->next, b = b->next)
+		if (a->addr != b->addr || a->size != b->size ||
+		    memcmp(a->data, b->data, a->size))
+			return 0;
+	return !b && a && !a->size && !a->next;
+}
+
+static int bench_ihex(size_t n, uint32_t size)
+{
+	FILE *f = ihex_create(n, size);
+	struct record *recs, *ref;
+	uint64_t t0, t1;
+	long len;
+	int r = 0;
+
+	if (!f || fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0)
+		FATAL(2,"error creating ihex file\n");
+	rewind(f);
+	t0 = mono_ns();
+	ref = old_read_ihex(f);
+	t1 = mono_ns();
+	printf("%9zu %4s %12.3f %12.1f %9s\n", n, "old", (t1 - t0) * 1e-6,
+	       len / ((t1 - t0) * 1e-3), ref ? "" : "FAILED");
+	r |= !ref;
+	rewind(f);
+	t0 = mono_ns();
+	recs = in_fmts[IN_FMT_IHEX].read(f);
+	t1 = mono_ns();
+	printf("%9zu %4s %12.3f %12.1f %9s\n", n, "new", (t1 - t0) * 1e-6,
+	       len / ((t1 - t0) * 1e-3),
+	       !recs || !ihex_same(ref, recs) ? "FAILED" : "");
+	fflush(stdout);
+	r |= !recs || !ihex_same(ref, recs);
+	record_free_all(ref);
+	record_free_all(recs);
+	fclose(f);
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	size_t n, max = 1000000, max_old = 100000, gap = 0;
+	uint32_t size = 16;
+	int opt, r = 0;
+
+	while ((opt = getopt(argc, argv, ":n:o:s:g:h")) != -1)
+		switch (opt) {
+		case 'n': max = strtoul(optarg, NULL, 0); break;
+		case 'o': max_old = strtoul(optarg, NULL, 0); break;
+		case 's': size = strtoul(optarg, NULL, 0); break;
+		case 'g': gap = strtoul(optarg, NULL, 0); break;
+		case 'h': USAGE(0,argv[0]);
+		case ':': FATAL(1,"option -%c needs a parameter\n",optopt);
+		case '?': FATAL(1,"illegal option: '-%c'\n", optopt);
+		}
+	if (optind != argc || !size)
+		USAGE(1,argv[0]);
+
+	if (size <= 0xff) {
+		printf("%9s %4s %12s %12s %9s\n", "records", "impl",
+		       "parse[ms]", "ihex[MB/s]", "");
+		for (n = 1000; n <= max; n *= 10)
+			r |= bench_ihex(n, size);
+	}
+	printf("%9s %4s %12s %12s %9s\n", "records", "impl", "sort[ms]",
+	       "merge[ms]", "merged");
+	for (n = 1000; n <= max; n *= 10) {
+		if (n <= max_old)
+			r |= bench("old", n, size, gap, old_sort, old_merge_adj);
+		r |= bench("new", n, size, gap, record_sort, record_merge_adj);
+	}
+	return r;
+}
@@ -0,0 +1,218 @@
+
+#define _POSIX_C_SOURCE		200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>		/* open() */
+#include <unistd.h>		/* close(), getpid() */
+#include <sys/stat.h>		/* fstat(), mkdir() */
+#include <sys/mman.h>		/* mmap() */
+
+#include "fwcache.h"
+#include "trace.h"
+
+/* An entry is a header followed by the records as laid out in memory, with
+ * next and block zeroed, so that it is used right from a private mapping once
+ * these are filled in. The key also covers the host's layout of records. */
+
+#define FW_CACHE_MAGIC		"fxcache1"
+
+#define FNV_OFFSET		UINT64_C(0xcbf29ce484222325)
+#define FNV_PRIME		UINT64_C(0x100000001b3)
+
+struct fw_cache_hdr {
+	char magic[8];
+	uint64_t key;		/* of the input's content and options */
+	uint64_t n;		/* records */
+	uint64_t len;		/* of the whole entry */
+	uint64_t sum;		/* of the records as stored */
+	struct record_block block;	/* filled in when mapped */
+};
+
+_Static_assert(sizeof(struct fw_cache_hdr) ==
+               offsetof(struct fw_cache_hdr, block) + sizeof(struct record_block),
+               "records must follow the block header");
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data, *end = p + len;
+
+	while (p < end)
+		h = (h ^ *p++) * FNV_PRIME;
+	return h;
+}
+
+static const char * fw_cache_dir(char *buf, size_t len)
+{
+	const char *path = getenv(ENV_FW_CACHE), *home;
+
+	if (path)
+		return *path ? path : NULL;
+	if (!(home = getenv("HOME")))
+		return NULL;
+	snprintf(buf, len, "%s/" DEFAULT_FW_CACHE, home);
+	return buf;
+}
+
+/* hashes the content of path, returns 1 unless it is a readable regular file */
+static int fw_cache_key(const char *path, unsigned fmt, int sort, int merge,
+                        uint64_t *key)
+{
+	/* the last ones differ with the host's layout and byte order */
+	const uint32_t opts[] = { fmt, sort, merge, sizeof(struct record), 1, };
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 1;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	    == MAP_FAILED) {
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	*key = fnv1a(fnv1a(FNV_OFFSET, map, st.st_size), opts, sizeof(opts));
+	munmap(map, st.st_size);
+	return 0;
+}
+
+/* returns the records of the entry, NULL if it is missing or unusable */
+static struct record * fw_cache_map(const char *file, uint64_t key)
+{
+	struct fw_cache_hdr *h;
+	struct record *head = NULL, **tail = &head, *r;
+	struct stat st;
+	uint8_t *at, *end;
+	uint64_t i;
+	void *map;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*h) ||
+	    (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	                fd, 0)) == MAP_FAILED) {
+		close(fd);
+		goto stale_unmapped;
+	}
+	close(fd);
+
+	h = map;
+	at = (uint8_t *)record_block_first(&h->block);
+	end = (uint8_t *)map + st.st_size;
+	if (memcmp(h->magic, FW_CACHE_MAGIC, sizeof(h->magic)) ||
+	    h->key != key || h->len != (uint64_t)st.st_size || !h->n ||
+	    fnv1a(FNV_OFFSET, at, end - at) != h->sum)
+		goto stale;
+	for (i=0; i<h->n; i++) {
+		r = (struct record *)at;
+		if ((size_t)(end - at) < offsetof(struct record, data) ||
+		    (size_t)(end - at) < record_span(r->size))
+			goto stale;
+		r->block = &h->block;
+		*tail = r;
+		tail = &r->next;
+		at += record_span(r->size);
+	}
+	if (at != end)
+		goto stale;
+	*tail = NULL;
+	h->block = (struct record_block){ map, st.st_size, };
+	return head;
+
+stale:
+	munmap(map, st.st_size);
+stale_unmapped:
+	fprintf(stderr, "warning: rebuilding stale cache entry %s\n", file);
+	return NULL;
+}
+
+/* writes recs to a temporary file renamed to file when complete */
+static int fw_cache_store(const char *dir, const char *file, uint64_t key,
+                          const struct record *recs)
+{
+	static const uint8_t pad[_Alignof(struct record)];
+	struct fw_cache_hdr h = {
+		FW_CACHE_MAGIC, key, 0, sizeof(h), FNV_OFFSET, { NULL, 0, },
+	};
+	const struct record *r;
+	struct record rh;
+	char tmp[4200];
+	size_t n_pad;
+	FILE *f;
+	int err;
+
+	if (mkdir(dir, 0777) && errno != EEXIST) {
+		perror(dir);
+		return 1;
+	}
+	for (r = recs; r; r = r->next) {
+		rh = (struct record){ NULL, NULL, r->addr, r->size, };
+		n_pad = record_span(r->size) - offsetof(struct record, data)
+		      - r->size;
+		h.sum = fnv1a(h.sum, &rh, offsetof(struct record, data));
+		h.sum = fnv1a(h.sum, r->data, r->size);
+		h.sum = fnv1a(h.sum, pad, n_pad);
+		h.len += record_span(r->size);
+		h.n++;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%ld", file, (long)getpid());
+	if (!(f = fopen(tmp, "w"))) {
+		perror(tmp);
+		return 1;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	for (r = recs; r; r = r->next) {
+		rh = (struct record){ NULL, NULL, r->addr, r->size, };
+		n_pad = record_span(r->size) - offsetof(struct record, data)
+		      - r->size;
+		fwrite(&rh, offsetof(struct record, data), 1, f);
+		fwrite(r->data, r->size, 1, f);
+		fwrite(pad, n_pad, 1, f);
+	}
+	err = ferror(f);
+	if (fclose(f) || err || rename(tmp, file)) {
+		perror(file);
+		remove(tmp);
+		return 1;
+	}
+	return 0;
+}
+
+static struct record * fw_cache_parse(const char *path, unsigned fmt,
+                                      int sort, int merge)
+{
+	struct record *recs = fw_read(path, fmt);
+
+	if (recs && sort)
+		recs = record_sort(recs);
+	if (recs && merge)
+		recs = record_merge_adj(recs);
+	return recs;
+}
+
+struct record * fw_cache_read(const char *path, unsigned fmt, int sort,
+                              int merge)
+{
+	char dir_buf[4096], file[4120];
+	const char *dir = fw_cache_dir(dir_buf, sizeof(dir_buf));
+	uint64_t key, t0 = trace_begin();
+	struct record *recs;
+
+	if (!dir || fw_cache_key(path, fmt, sort, merge, &key))
+		return fw_cache_parse(path, fmt, sort, merge);
+	snprintf(file, sizeof(file), "%s/%016" PRIx64, dir, key);
+	if ((recs = fw_cache_map(file, key))) {
+		trace_end("image", "cache", t0, "\"hit\":true");
+		return recs;
+	}
+	trace_end("image", "cache", t0, "\"hit\":false");
+	if ((recs = fw_cache_parse(path, fmt, sort, merge)))
+		fw_cache_store(dir, file, key, recs);
+	return recs;
+}
@@ -0,0 +1,19 @@
+
+#ifndef FWCACHE_H
+#define FWCACHE_H
+
+#include "fw.h"
+
+/* directory of parsed images, one file per input content and options */
+#define ENV_FW_CACHE		"FXPROG_CACHE"
+#define DEFAULT_FW_CACHE	".fxprog-cache" /* in $HOME */
+
+/* Returns the records of the image at path read in format fmt, sorted and
+ * merged as requested. The result for a regular file is stored in the cache
+ * directory, keyed by a hash of its content and the options, and later calls
+ * map it from there instead of parsing the file again. Entries failing their
+ * checks are rebuilt. An empty $FXPROG_CACHE disables the cache. */
+struct record * fw_cache_read(const char *path, unsigned fmt, int sort,
+                              int merge);
+
+#endif
@@ -0,0 +1,273 @@
+
+#define _XOPEN_SOURCE		700	/* realpath() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>		/* PATH_MAX */
+#include <unistd.h>		/* getopt(), optind */
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "usb.h"		/* ENV_DEV_ADDR */
+#include "proto.h"
+
+/* Thin client for fxd: translates the command lines of ctl, bulk and fxprog
+ * (load and dump) into requests and reproduces their output and exit
+ * status. */
+
+#define USAGE(ret,progname)	FATAL(ret,"\
+usage: %s [-S <socket>] ctl [-c <dev>] <bmRequestType> <bRequest> <wValue> <wIndex> <wLength> [<timeout_ms>]\n\
+       %s [-S <socket>] bulk [-c <dev>] [-C <num>] <ep> <len> [<timeout_ms>]\n\
+       %s [-S <socket>] fxprog [-c <dev>] [-f <fmt>] [-s] [-m] -i <fw.dat>\n\
+       %s [-S <socket>] fxprog [-c <dev>] -d <addr>{:<to>|+<size>}\n\
+       %s [-S <socket>] close [-c <dev>]\n\
+       %s [-S <socket>] stats\n\
+\n\
+Runs the operation in fxd, which keeps devices and firmware images open.\n\
+<dev> is {<bus>.<addr> | <vid>:<pid>} (default: $" ENV_DEV_ADDR ", for fxprog\n\
+the only FX2/FX3 device).\n\
+\n\
+  -S <socket> path of fxd's socket (default: $" ENV_FXD_SOCKET " or\n\
+              " DEFAULT_FXD_SOCKET ")\n\
+",progname,progname,progname,progname,progname,progname)
+
+struct fxc_req {
+	char *argv[PROTO_MAX_ARGS + 1];
+	int argc;
+	uint8_t *payload;
+	size_t len;
+};
+
+static void req_arg(struct fxc_req *q, const char *s)
+{
+	if (q->argc == PROTO_MAX_ARGS)
+		FATAL(1,"too many arguments\n");
+	q->argv[q->argc++] = (char *)s;
+}
+
+/* reads exactly len bytes of payload from stdin */
+static int req_read_stdin(struct fxc_req *q, size_t len)
+{
+	if (!(q->payload = malloc(len ? len : 1)))
+		return 2;
+	if (len && !fread(q->payload, len, 1, stdin)) {
+		fprintf(stderr, "error reading %zu bytes from stdin: %s\n",
+			len, strerror(errno));
+		return 2;
+	}
+	q->len = len;
+	return 0;
+}
+
+static const char * opt_dev(int argc, char **argv, const char *optstring,
+                            int (*opt_cb)(int opt, void *arg), void *arg)
+{
+	const char *dev = getenv(ENV_DEV_ADDR);
+	int opt;
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, optstring)) != -1)
+		switch (opt) {
+		case 'c': dev = optarg; break;
+		case ':': FATAL(1,"option -%c needs a parameter\n",optopt);
+		case '?': FATAL(1,"illegal option: '-%c'\n", optopt);
+		default:
+			if (!opt_cb || opt_cb(opt, arg))
+				FATAL(1,"illegal option: '-%c'\n", opt);
+		}
+	return dev ? dev : "";
+}
+
+static int parse_ctl(struct fxc_req *q, int argc, char **argv)
+{
+	const char *dev = opt_dev(argc, argv, "+:c:", NULL, NULL);
+	int i;
+
+	if (argc - optind < 5 || argc - optind > 6)
+		return 1;
+	req_arg(q, "ctl");
+	req_arg(q, dev);
+	for (i=optind; i<argc; i++)
+		req_arg(q, argv[i]);
+	unsigned long bmRequestType = strtoul(argv[optind], NULL, 0);
+	unsigned long wLength = strtoul(argv[optind + 4], NULL, 0);
+	return req_read_stdin(q, ~bmRequestType & 0x80 ? wLength : 0);
+}
+
+static int bulk_opt(int opt, void *arg)
+{
+	if (opt != 'C')
+		return 1;
+	*(const char **)arg = optarg;
+	return 0;
+}
+
+static int parse_bulk(struct fxc_req *q, int argc, char **argv)
+{
+	const char *count = "1";
+	const char *dev = opt_dev(argc, argv, "+:c:C:", bulk_opt, &count);
+
+	if (argc - optind < 2 || argc - optind > 3 || atol(count) < 1)
+		return 1;
+	req_arg(q, "bulk");
+	req_arg(q, dev);
+	req_arg(q, argv[optind]);
+	req_arg(q, argv[optind + 1]);
+	req_arg(q, argc - optind > 2 ? argv[optind + 2] : "500");
+	req_arg(q, count);
+	unsigned long ep = strtoul(argv[optind], NULL, 0);
+	unsigned long len = strtoul(argv[optind + 1], NULL, 0);
+	return req_read_stdin(q, ~ep & 0x80 ? len * atol(count) : 0);
+}
+
+struct fxprog_opts {
+	const char *in, *fmt, *dump;
+	int sort, merge;
+};
+
+static int fxprog_opt(int opt, void *arg)
+{
+	struct fxprog_opts *o = arg;
+	switch (opt) {
+	case 'i': o->in   = optarg; break;
+	case 'f': o->fmt  = optarg; break;
+	case 'd': o->dump = optarg; break;
+	case 's': o->sort = 1; break;
+	case 'm': o->merge = 0; break;
+	default: return 1;
+	}
+	return 0;
+}
+
+static int parse_fxprog(struct fxc_req *q, int argc, char **argv)
+{
+	static char path[PATH_MAX], addr[32], size[32];
+	struct fxprog_opts o = { NULL, "ihex", NULL, 0, 1 };
+	const char *dev = opt_dev(argc, argv, "+:c:i:f:d:sm", fxprog_opt, &o);
+
+	if (optind != argc || !o.in == !o.dump)
+		return 1;
+	if (o.in) {
+		/* fxd has its own working directory */
+		if (!realpath(o.in, path)) {
+			perror(o.in);
+			return 2;
+		}
+		req_arg(q, "load");
+		req_arg(q, dev);
+		req_arg(q, path);
+		req_arg(q, o.fmt);
+		req_arg(q, o.sort ? "1" : "0");
+		req_arg(q, o.merge ? "1" : "0");
+	} else {
+		char *endptr, c;
+		long from = strtol(o.dump, &endptr, 0), num;
+		c = *endptr++;
+		if (from < 0 || (c != ':' && c != '+') ||
+		    (num = strtol(endptr, &endptr, 0)) < 0 || *endptr ||
+		    (c == ':' && num < from))
+			FATAL(1,"invalid dump syntax (-d): %s\n",o.dump);
+		if (c == ':')
+			num -= from;
+		snprintf(addr, sizeof(addr), "%ld", from);
+		snprintf(size, sizeof(size), "%ld", num);
+		req_arg(q, "dump");
+		req_arg(q, dev);
+		req_arg(q, addr);
+		req_arg(q, size);
+	}
+	return 0;
+}
+
+static int parse_close(struct fxc_req *q, int argc, char **argv)
+{
+	const char *dev = opt_dev(argc, argv, "+:c:", NULL, NULL);
+
+	if (optind != argc)
+		return 1;
+	req_arg(q, "close");
+	req_arg(q, dev);
+	return 0;
+}
+
+static int parse_stats(struct fxc_req *q, int argc, char **argv)
+{
+	if (argc != 1)
+		return 1;
+	req_arg(q, "stats");
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*parse)(struct fxc_req *q, int argc, char **argv);
+} tools[] = {
+	{ "ctl", parse_ctl, },
+	{ "bulk", parse_bulk, },
+	{ "fxprog", parse_fxprog, },
+	{ "close", parse_close, },
+	{ "stats", parse_stats, },
+};
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct proto_buf out = { 0 }, err = { 0 };
+	struct fxc_req q = { .argc = 0, };
+	const char *path = NULL;
+	int32_t status;
+	unsigned i;
+	int opt, fd, r;
+
+	while ((opt = getopt(argc, argv, "+:S:h")) != -1)
+		switch (opt) {
+		case 'S': path = optarg; break;
+		case 'h': USAGE(0,argv[0]);
+		case ':': FATAL(1,"option -%c needs a parameter\n",optopt);
+		case '?': FATAL(1,"illegal option: '-%c'\n", optopt);
+		}
+	if (optind == argc)
+		USAGE(1,argv[0]);
+
+	for (i=0; i<ARRAY_SIZE(tools); i++)
+		if (!strcmp(argv[optind], tools[i].name))
+			break;
+	if (i == ARRAY_SIZE(tools))
+		USAGE(1,argv[0]);
+	r = tools[i].parse(&q, argc - optind, argv + optind);
+	if (r == 1)
+		USAGE(1,argv[0]);
+	if (r)
+		return r;
+
+	path = proto_socket_path(path);
+	if (strlen(path) >= sizeof(sa.sun_path))
+		FATAL(1,"socket path too long: %s\n",path);
+	strcpy(sa.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		fprintf(stderr, "error connecting to fxd on %s: %s\n", path,
+			strerror(errno));
+		return 2;
+	}
+
+	if (proto_send_req(fd, q.argc, q.argv, q.payload, q.len) ||
+	    proto_read_all(fd, &status, sizeof(status)) ||
+	    proto_recv_buf(fd, &out) || proto_recv_buf(fd, &err)) {
+		fprintf(stderr, "error communicating with fxd\n");
+		return 2;
+	}
+	close(fd);
+
+	if (out.len)
+		fwrite(out.data, out.len, 1, stdout);
+	if (err.len)
+		fwrite(err.data, err.len, 1, stderr);
+	free(out.data);
+	free(err.data);
+	free(q.payload);
+	return status;
+}
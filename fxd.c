@@ -0,0 +1,625 @@
+
+#define _POSIX_C_SOURCE		200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt(), unlink() */
+#include <signal.h>		/* sigaction() */
+#include <sys/socket.h>
+#include <sys/stat.h>		/* stat() */
+#include <sys/un.h>
+#include <libusb.h>
+
+#include "common.h"
+#include "usb.h"
+#include "stream.h"		/* stream_report_req */
+#include "fw.h"
+#include "fwcache.h"
+#include "load.h"
+#include "proto.h"
+#include "trace.h"
+
+/* Resident daemon: keeps the libusb context, opened devices and parsed
+ * firmware images around and serves requests from fxc over a Unix domain
+ * socket, one connection at a time. */
+
+#define DEFAULT_TIMEOUT		500 /* ms */
+#define DEFAULT_CTRL_DEPTH	4
+
+struct fxd_dev {
+	struct fxd_dev *next;
+	char *sel;		/* device selector as given by the client */
+	struct dev_spec spec;
+	libusb_device_handle *hdev;
+	struct ctrlq cq;
+	unsigned chunk;		/* bytes per firmware load request */
+	uint32_t claimed;	/* bit mask of claimed interfaces */
+};
+
+struct fxd_img {
+	struct fxd_img *next;
+	char *path;
+	unsigned fmt;
+	int sort, merge;
+	struct timespec mtime;
+	off_t size;
+	struct record *recs;
+};
+
+enum fxd_op { OP_CTL, OP_BULK, OP_LOAD, OP_DUMP, OP_STATS, OP_CLOSE, N_OPS };
+
+struct fxd {
+	libusb_context *ctx;
+	struct fxd_dev *devs;
+	struct fxd_img *imgs;
+
+	/* per-operation accounting */
+	struct hist lat[N_OPS];		/* request handling time in ns */
+	uint64_t n_req[N_OPS], n_err[N_OPS];
+	uint64_t n_img_hits, n_img_loads;
+};
+
+struct fxd_req {
+	int argc;
+	char **argv;
+	const struct proto_buf *in;
+	struct proto_buf *out, *err;
+};
+
+static volatile sig_atomic_t quit;
+
+/* devices */
+
+static void fxd_dev_drop(struct fxd *d, struct fxd_dev *dev)
+{
+	struct fxd_dev **p;
+	unsigned i;
+
+	for (p = &d->devs; *p != dev; p = &(*p)->next);
+	*p = dev->next;
+	for (i=0; i<32; i++)
+		if (dev->claimed & UINT32_C(1) << i)
+			libusb_release_interface(dev->hdev, i);
+	ctrlq_fini(&dev->cq);
+	libusb_close(dev->hdev);
+	free(dev->sel);
+	free(dev);
+}
+
+static struct fxd_dev * fxd_dev_get(struct fxd *d, const char *sel,
+                                    struct proto_buf *err)
+{
+	struct load_profile p = { 0, 0 };
+	struct fxd_dev *dev;
+	char *msg = NULL;
+	size_t n_msg = 0, len0 = err->len;
+
+	for (dev = d->devs; dev; dev = dev->next)
+		if (!strcmp(dev->sel, sel))
+			return dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev || !(dev->sel = strdup(sel)))
+		goto err;
+	/* the client gets the messages the plain tools print when opening */
+	usb_msg_out = open_memstream(&msg, &n_msg);
+	if (!*sel || !usb_common_parse_spec(&dev->spec, sel))
+		dev->hdev = usb_common_find_device(d->ctx, &dev->spec,
+		                                   dev_types, N_DEV_TYPES);
+	if (usb_msg_out) {
+		fclose(usb_msg_out);
+		usb_msg_out = NULL;
+		proto_put(err, msg, n_msg);
+		free(msg);
+	}
+	if (!dev->hdev)
+		goto err;
+	load_profile_get(&p, dev->spec.dev_type, libusb_get_device(dev->hdev));
+	dev->chunk = p.chunk;
+	dev->cq = (struct ctrlq)CTRLQ_INIT(dev->hdev, DEFAULT_CTRL_DEPTH,
+	                                   p.timeout);
+	if (ctrlq_init(&dev->cq)) {
+		libusb_close(dev->hdev);
+		goto err;
+	}
+	dev->next = d->devs;
+	d->devs = dev;
+	return dev;
+err:
+	if (err->len == len0)
+		proto_printf(err, "cannot open device '%s'\n", sel);
+	if (dev)
+		free(dev->sel);
+	free(dev);
+	return NULL;
+}
+
+/* the device is re-opened on the next request if it went away */
+static int fxd_dev_check(struct fxd *d, struct fxd_dev *dev, int r)
+{
+	if (r == LIBUSB_ERROR_NO_DEVICE)
+		fxd_dev_drop(d, dev);
+	return r;
+}
+
+/* whether the control requests run on dev failed since it went away, e.g.
+ * re-enumerated, before any of them got through; dev is dropped then */
+static int fxd_dev_gone(struct fxd *d, struct fxd_dev *dev)
+{
+	if (dev->cq.n_done || dev->cq.result != LIBUSB_ERROR_NO_DEVICE)
+		return 0;
+	fxd_dev_drop(d, dev);
+	return 1;
+}
+
+static int fxd_dev_claim_ep(struct fxd_dev *dev, uint8_t ep,
+                            struct proto_buf *err)
+{
+	int iface, alt, r;
+
+	if (usb_common_find_ep(dev->hdev, ep, &iface, &alt) || iface >= 32) {
+		proto_printf(err, "endpoint 0x%02x not found\n", ep);
+		return 3;
+	}
+	if (dev->claimed & UINT32_C(1) << iface)
+		return 0;
+	if ((r = libusb_claim_interface(dev->hdev, iface)) ||
+	    (alt && (r = libusb_set_interface_alt_setting(dev->hdev, iface,
+	                                                  alt)))) {
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			return r;	/* left to the caller */
+		proto_printf(err, "error claiming interface %d: %s\n", iface,
+		             libusb_error_name(r));
+		return 3;
+	}
+	dev->claimed |= UINT32_C(1) << iface;
+	return 0;
+}
+
+/* images */
+
+static struct fxd_img * fxd_img_get(struct fxd *d, const char *path,
+                                    unsigned fmt, int sort, int merge,
+                                    struct proto_buf *err)
+{
+	struct fxd_img *img, **p;
+	struct stat st;
+
+	if (stat(path, &st)) {
+		proto_printf(err, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	for (p = &d->imgs; (img = *p); p = &img->next) {
+		if (strcmp(img->path, path) || img->fmt != fmt ||
+		    img->sort != sort || img->merge != merge)
+			continue;
+		if (img->size == st.st_size &&
+		    img->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    img->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+			d->n_img_hits++;
+			return img;
+		}
+		/* changed on disk */
+		*p = img->next;
+		record_free_all(img->recs);
+		free(img->path);
+		free(img);
+		break;
+	}
+
+	struct record *recs = fw_cache_read(path, fmt, sort, merge);
+	if (!recs) {
+		proto_printf(err, "error reading firmware image %s\n", path);
+		return NULL;
+	}
+	if (!(img = calloc(1, sizeof(*img))) || !(img->path = strdup(path))) {
+		record_free_all(recs);
+		free(img);
+		return NULL;
+	}
+	img->fmt = fmt;
+	img->sort = sort;
+	img->merge = merge;
+	img->mtime = st.st_mtim;
+	img->size = st.st_size;
+	img->recs = recs;
+	img->next = d->imgs;
+	d->imgs = img;
+	d->n_img_loads++;
+	return img;
+}
+
+/* operations, each returns the exit status of the respective tool */
+
+/* ctl <dev> <bmRequestType> <bRequest> <wValue> <wIndex> <wLength> [<timeout>]
+ * payload: OUT data, output: IN data */
+static int op_ctl(struct fxd *d, struct fxd_req *q)
+{
+	struct fxd_dev *dev;
+	uint8_t buf[0xffff];
+	int r, retried = 0;
+
+	if (q->argc < 7 || q->argc > 8)
+		return 1;
+	uint8_t  bmRequestType = strtol(q->argv[2], NULL, 0);
+	uint8_t  bRequest      = strtol(q->argv[3], NULL, 0);
+	uint16_t wValue        = strtol(q->argv[4], NULL, 0);
+	uint16_t wIndex        = strtol(q->argv[5], NULL, 0);
+	uint16_t wLength       = strtol(q->argv[6], NULL, 0);
+	unsigned timeout = q->argc > 7 ? strtol(q->argv[7], NULL, 0)
+	                               : DEFAULT_TIMEOUT;
+
+	if (~bmRequestType & 0x80) {
+		if (q->in->len < wLength) {
+			proto_printf(q->err, "error reading %hu bytes from "
+			             "stdin\n", wLength);
+			return 2;
+		}
+		memcpy(buf, q->in->data, wLength);
+	}
+retry:
+	if (!(dev = fxd_dev_get(d, q->argv[1], q->err)))
+		return 2;
+	r = libusb_control_transfer(dev->hdev, bmRequestType, bRequest, wValue,
+	                            wIndex, buf, wLength, timeout);
+	/* a stale handle, the device re-enumerated since it was opened */
+	if (fxd_dev_check(d, dev, r) == LIBUSB_ERROR_NO_DEVICE && !retried++)
+		goto retry;
+	if (r < 0) {
+		proto_printf(q->err, "error during control transfer: %s\n",
+		             libusb_error_name(r));
+		return 3;
+	}
+	if (bmRequestType & 0x80)
+		proto_put(q->out, buf, r);
+	return 0;
+}
+
+/* bulk <dev> <ep> <len> [<timeout> [<count>]]
+ * payload: count * len OUT bytes, output: IN data */
+static int op_bulk(struct fxd *d, struct fxd_req *q)
+{
+	struct fxd_dev *dev;
+	uint8_t *buf;
+	int tferd, r = 0, retried = 0;
+	long n;
+
+	if (q->argc < 4 || q->argc > 6)
+		return 1;
+	uint8_t ep = strtol(q->argv[2], NULL, 0);
+	unsigned len = strtol(q->argv[3], NULL, 0);
+	unsigned timeout = q->argc > 4 ? strtol(q->argv[4], NULL, 0)
+	                               : DEFAULT_TIMEOUT;
+	long count = q->argc > 5 ? strtol(q->argv[5], NULL, 0) : 1;
+
+	if (count < 1)
+		return 1;
+	if (~ep & 0x80 && q->in->len < (size_t)count * len) {
+		proto_printf(q->err, "error reading %lu bytes from stdin\n",
+		             count * len);
+		return 2;
+	}
+retry:
+	if (!(dev = fxd_dev_get(d, q->argv[1], q->err)))
+		return 2;
+	if ((r = fxd_dev_claim_ep(dev, ep, q->err)) == LIBUSB_ERROR_NO_DEVICE) {
+		fxd_dev_drop(d, dev);
+		if (!retried++)
+			goto retry;
+		proto_printf(q->err, "error claiming interface: %s\n",
+		             libusb_error_name(r));
+		return 3;
+	}
+	if (r)
+		return r;
+	if (!(buf = malloc(len ? len : 1)))
+		return 2;
+	for (n=0; n<count; n++) {
+		if (~ep & 0x80)
+			memcpy(buf, q->in->data + n * len, len);
+		r = libusb_bulk_transfer(dev->hdev, ep, buf, len, &tferd,
+		                         timeout);
+		/* a stale handle, the device re-enumerated since it was
+		 * opened */
+		if (!n && fxd_dev_check(d, dev, r) == LIBUSB_ERROR_NO_DEVICE &&
+		    !retried++) {
+			free(buf);
+			goto retry;
+		}
+		if (r) {
+			proto_printf(q->err, "error during bulk transfer: %s\n",
+			             libusb_error_name(r));
+			if (n)
+				fxd_dev_check(d, dev, r);
+			r = 5;
+			break;
+		}
+		if (ep & 0x80)
+			proto_put(q->out, buf, tferd);
+	}
+	free(buf);
+	return r;
+}
+
+/* load <dev> <path> <format> <sort> <merge> */
+static int op_load(struct fxd *d, struct fxd_req *q)
+{
+	struct fxd_dev *dev;
+	struct fxd_img *img;
+	unsigned fmt;
+	int r, retried = 0;
+
+	if (q->argc != 6)
+		return 1;
+	for (fmt=0; fmt<N_IN_FMTS; fmt++)
+		if (!strcmp(q->argv[3], in_fmts[fmt].name))
+			break;
+	if (fmt == N_IN_FMTS) {
+		proto_printf(q->err, "unknown input format: %s\n", q->argv[3]);
+		return 1;
+	}
+	if (!(img = fxd_img_get(d, q->argv[2], fmt, atoi(q->argv[4]),
+	                        atoi(q->argv[5]), q->err)))
+		return 2;
+retry:
+	if (!(dev = fxd_dev_get(d, q->argv[1], q->err)))
+		return 2;
+	r = usb_load_firmware(d->ctx, &dev->cq,
+	                      dev->spec.dev_type == &dev_types[DEV_FX2],
+	                      dev->chunk, img->recs);
+	if (r && fxd_dev_gone(d, dev)) {
+		if (!retried++)
+			goto retry;
+	} else {
+		/* after loading, the device usually re-enumerates: the handle
+		 * goes stale, the next request opens it again */
+		fxd_dev_drop(d, dev);
+	}
+	if (r)
+		proto_printf(q->err, "error uploading firmware\n");
+	return r ? 3 : 0;
+}
+
+/* dump <dev> <addr> <size>, output: RAM contents */
+static int op_dump(struct fxd *d, struct fxd_req *q)
+{
+	struct fxd_dev *dev;
+	struct record *rec;
+	uint32_t size;
+	int r, retried = 0;
+
+	if (q->argc != 4)
+		return 1;
+	size = strtoul(q->argv[3], NULL, 0);
+	if (!(rec = record_create(strtoul(q->argv[2], NULL, 0), size)))
+		return 2;
+retry:
+	if (!(dev = fxd_dev_get(d, q->argv[1], q->err))) {
+		free(rec);
+		return 2;
+	}
+	r = usb_control_tfer(d->ctx, &dev->cq, 0xc0, USB_REQ_FIRMWARE_LOAD,
+	                     dev->chunk, rec, &rec->size);
+	/* a stale handle, the device re-enumerated since it was opened */
+	if (r && fxd_dev_gone(d, dev) && !retried++) {
+		rec->size = size;
+		goto retry;
+	}
+	proto_put(q->out, rec->data, rec->size);
+	free(rec);
+	if (r)
+		proto_printf(q->err, "error dumping RAM\n");
+	return r ? 3 : 0;
+}
+
+static const char *op_names[N_OPS] = {
+	[OP_CTL  ] = "ctl",
+	[OP_BULK ] = "bulk",
+	[OP_LOAD ] = "load",
+	[OP_DUMP ] = "dump",
+	[OP_STATS] = "stats",
+	[OP_CLOSE] = "close",
+};
+
+static void fxd_report(const struct fxd *d, FILE *f)
+{
+	const struct fxd_dev *dev;
+	unsigned i, n_devs = 0;
+
+	for (dev = d->devs; dev; dev = dev->next)
+		n_devs++;
+	fprintf(f, "%u open devices, images: %" PRIu64 " parsed, %" PRIu64
+		" cached uses\n", n_devs, d->n_img_loads, d->n_img_hits);
+	for (i=0; i<N_OPS; i++) {
+		if (!d->n_req[i])
+			continue;
+		fprintf(f, "%s: %" PRIu64 " requests, %" PRIu64 " failed\n",
+			op_names[i], d->n_req[i], d->n_err[i]);
+		hist_report(&d->lat[i], op_names[i], f);
+	}
+}
+
+static int op_stats(struct fxd *d, struct fxd_req *q)
+{
+	char *s = NULL;
+	size_t n = 0;
+	FILE *f = open_memstream(&s, &n);
+
+	if (!f)
+		return 2;
+	fxd_report(d, f);
+	fclose(f);
+	proto_put(q->out, s, n);
+	free(s);
+	return 0;
+}
+
+/* close <dev>: forget an opened device, e.g. after it re-enumerated */
+static int op_close(struct fxd *d, struct fxd_req *q)
+{
+	struct fxd_dev *dev;
+
+	if (q->argc != 2)
+		return 1;
+	for (dev = d->devs; dev; dev = dev->next)
+		if (!strcmp(dev->sel, q->argv[1])) {
+			fxd_dev_drop(d, dev);
+			break;
+		}
+	return 0;
+}
+
+static int (*const ops[N_OPS])(struct fxd *d, struct fxd_req *q) = {
+	[OP_CTL  ] = op_ctl,
+	[OP_BULK ] = op_bulk,
+	[OP_LOAD ] = op_load,
+	[OP_DUMP ] = op_dump,
+	[OP_STATS] = op_stats,
+	[OP_CLOSE] = op_close,
+};
+
+/* serves requests on one connection until the client closes it */
+static void fxd_serve(struct fxd *d, int fd)
+{
+	struct proto_buf args = { 0 }, in = { 0 }, out = { 0 }, err = { 0 };
+	char *argv[PROTO_MAX_ARGS + 1];
+	struct fxd_req q = { .argv = argv, .in = &in, .out = &out, .err = &err };
+	uint64_t t0;
+	unsigned op;
+	int32_t status;
+
+	while (!quit && !proto_recv_req(fd, &q.argc, argv, &args, &in)) {
+		t0 = mono_ns();
+		out.len = err.len = 0;
+		for (op=0; op<N_OPS; op++)
+			if (q.argc && !strcmp(argv[0], op_names[op]))
+				break;
+		if (op == N_OPS) {
+			proto_printf(&err, "unknown operation '%s'\n",
+			             q.argc ? argv[0] : "");
+			status = 1;
+		} else {
+			status = ops[op](d, &q);
+			if (status == 1 && !err.len)
+				proto_printf(&err, "invalid arguments for "
+				             "'%s'\n", argv[0]);
+			hist_add(&d->lat[op], mono_ns() - t0);
+			d->n_req[op]++;
+			d->n_err[op] += status != 0;
+		}
+		if (proto_write_all(fd, &status, sizeof(status)) ||
+		    proto_send_buf(fd, out.data, out.len) ||
+		    proto_send_buf(fd, err.data, err.len))
+			break;
+		if (stream_report_req) {
+			stream_report_req = 0;
+			fxd_report(d, stderr);
+		}
+	}
+	free(args.data);
+	free(in.data);
+	free(out.data);
+	free(err.data);
+}
+
+static void on_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		stream_report_req = 1;
+	else
+		quit = 1;
+}
+
+#define USAGE(ret,progname)	FATAL(ret,"\
+usage: %s [-S <socket>]\n\
+\n\
+Keeps libusb, opened devices and parsed firmware images resident and serves\n\
+requests from fxc. Statistics are printed on SIGUSR1 and on exit.\n\
+\n\
+  -S <socket> path of the Unix domain socket (default: $" ENV_FXD_SOCKET " or\n\
+              " DEFAULT_FXD_SOCKET ")\n\
+",progname)
+
+int main(int argc, char **argv)
+{
+	struct fxd d = { 0 };
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	const char *path = NULL;
+	struct fxd_img *img;
+	unsigned i;
+	int opt, fd, c, r;
+
+	while ((opt = getopt(argc, argv, ":S:h")) != -1)
+		switch (opt) {
+		case 'S': path = optarg; break;
+		case 'h': USAGE(0,argv[0]);
+		case ':': FATAL(1,"option -%c needs a parameter\n",optopt);
+		case '?': FATAL(1,"illegal option: '-%c'\n", optopt);
+		}
+	if (optind != argc)
+		USAGE(1,argv[0]);
+
+	path = proto_socket_path(path);
+	if (strlen(path) >= sizeof(sa.sun_path))
+		FATAL(1,"socket path too long: %s\n",path);
+	strcpy(sa.sun_path, path);
+
+	for (i=0; i<N_OPS; i++)
+		hist_init(&d.lat[i]);
+	load_verbose = 0;
+	trace_init();
+	if ((r = libusb_init(&d.ctx)))
+		FATAL(1,"error initializing libusb: %s\n",
+		      libusb_error_name(r));
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) || listen(fd, 8)) {
+		perror(path);
+		return 1;
+	}
+
+	/* no SA_RESTART: accept() returns on SIGINT / SIGTERM */
+	sigaction(SIGINT, &(struct sigaction){ .sa_handler = on_signal }, NULL);
+	sigaction(SIGTERM, &(struct sigaction){ .sa_handler = on_signal }, NULL);
+	sigaction(SIGUSR1, &(struct sigaction){
+		.sa_handler = on_signal, .sa_flags = SA_RESTART,
+	}, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "listening on %s\n", path);
+	while (!quit) {
+		if ((c = accept(fd, NULL, NULL)) < 0) {
+			if (errno != EINTR) {
+				perror("accept");
+				break;
+			}
+			if (stream_report_req) {
+				stream_report_req = 0;
+				fxd_report(&d, stderr);
+			}
+			continue;
+		}
+		fxd_serve(&d, c);
+		close(c);
+	}
+
+	close(fd);
+	unlink(path);
+	fxd_report(&d, stderr);
+	while (d.devs)
+		fxd_dev_drop(&d, d.devs);
+	while ((img = d.imgs)) {
+		d.imgs = img->next;
+		record_free_all(img->recs);
+		free(img->path);
+		free(img);
+	}
+	libusb_exit(d.ctx);
+	return 0;
+}
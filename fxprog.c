@@ -6,11 +6,17 @@
 #include <string.h> /* strcmp() */
 #include <stddef.h> /* offsetof() */
 #include <unistd.h> /* getopt() */
+#include <signal.h> /* sigaction() */
 #include <libusb.h>
-#include <sys/stat.h> /* fstat() */
-#include <setjmp.h> /* yeah, yeah, evil... */
 
 #include "usb.h"
+#include "stream.h"
+#include "ctrlq.h"
+#include "fw.h"
+#include "fwcache.h"
+#include "load.h"
+#include "fleet.h"
+#include "hotplug.h"
 
 #ifdef _POSIX_MAPPED_FILES
 # include <sys/mman.h> /* mmap() */
@@ -21,411 +27,182 @@
 // #define DEFAULT_DEV_TYPE	"fx2"
 #define DEFAULT_DUMP_FMT	"bin"
 #define DEFAULT_TIMEOUT		200 /* ms */
+#define DEFAULT_CTRL_DEPTH	4 /* control requests in flight */
+#define DEFAULT_BENCH_LEN	16384
+#define DEFAULT_BENCH_DEPTH	8
+#define DEFAULT_BENCH_SECS	5
+#define DEFAULT_BENCH_TIMEOUT	1000 /* ms */
+#define DEFAULT_RENUM_TIMEOUT	5000 /* ms */
 
 #define DEFAULT_I2C_CONF	0x0e /* 128 KB Microchip EEPROM @ 100kHz */
 #define DEFAULT_IMG_TYPE	0xb0 /* binary */
 
-#define USB_REQ_FIRMWARE_LOAD	0xa0
-#define FX2_REG_CPUCS		0xe600
+/* endpoint benchmark */
 
-#define VID_CYPRESS		0x04b4
-#define PID_FX2			0x8613 /* default boot image identification */
-#define PID_FX3			0x00f3 /* default boot image identification */
-
-enum dev_type_t { DEV_FX2, DEV_FX3 };
-
-static const struct dev_type dev_types[] = {
-	[DEV_FX2] = { "fx2", { VID_CYPRESS, PID_FX2 } },
-	[DEV_FX3] = { "fx3", { VID_CYPRESS, PID_FX3 } },
-};
-
-/* firmware data types */
-struct record {
-	struct record *next;
-	uint32_t addr;
-	uint32_t size;
-	uint8_t data[];
-};
-
-static struct record * record_create(uint32_t addr, uint32_t size)
-{
-	struct record *r = malloc(offsetof(struct record, data) + size);
-	r->next = NULL;
-	r->addr = addr;
-	r->size = size;
-	return r;
-}
-
-static struct record * record_read_ihex(FILE *f);
-static struct record * record_read_cyfw(FILE *f);
-static struct record * record_read_bin(FILE *f);
-
-/* support tables */
-static const struct {
-	const char *name;
-	struct record * (*read)(FILE *f);
-} in_fmts[] = {
-	{ "ihex", record_read_ihex, },
-	{ "cyfw", record_read_cyfw, },
-	{ "bin", record_read_bin, }
-};
-
-static const struct {
-	const char *name;
-} dump_fmts[] = {
-	{ "bin", },
+struct bench {
+	uint8_t ep;
+	unsigned len;
+	unsigned depth;
+	double secs;
 };
 
-/* firmware input helper functions */
-
-static struct record * record_merge_adj(struct record *head)
-{
-	struct record hd = { .next = head, };
-	struct record *prev = &hd, *cur, *next;
-
-	while ((cur = prev->next) != NULL && (next = cur->next) != NULL) {
-		if (cur->addr + cur->size != next->addr) {
-			prev = cur;
-			continue;
-		}
-		cur = realloc(cur, offsetof(struct record, data) + cur->size + next->size);
-		prev->next = cur;
-		cur->next = next->next;
-		memcpy(cur->data + cur->size, next->data, next->size);
-		cur->size += next->size;
-		free(next);
-	}
-
-	return hd.next;
-}
-
-/* simple linear insertion sort;
- * lexicograph. ordering: 1.addr, 2.size, enables size 0 entries to be merged */
-static struct record * record_sort(struct record *head)
-{
-	struct record ret = { .next = NULL, };
-	struct record *prev, *it, *next;
-
-	for (; head; head = next) {
-		next = head->next;
-		for (prev = &ret; (it = prev->next) != NULL; prev = it)
-			if ((it->addr >  head->addr) ||
-			    (it->addr == head->addr && it->size > head->size))
-				break;
-		prev->next = head;
-		head->next = it;
-	}
-
-	return ret.next;
-}
-
-/* read ihex */
-
-static jmp_buf ihex_jmp_buf;
-
-static uint8_t nibble(char c)
+/* OUT buffers are synthesized once in usb_benchmark(), just resend them */
+static int bench_fill(struct stream *s, uint8_t *buf, unsigned len)
 {
-	if ('0' <= c && c <= '9') return c - '0';
-	if ('A' <= c && c <= 'F') return c - 'A' + 10;
-	if ('a' <= c && c <= 'f') return c - 'a' + 10;
-	longjmp(ihex_jmp_buf, 0x100 | (c & 0xff));
+	return len;
 }
 
-static uint8_t hex(const char *data, uint8_t *crc)
+static int bench_drain(struct stream *s, const uint8_t *buf, unsigned len)
 {
-	uint8_t r = nibble(data[0]) << 4 | nibble(data[1]);
-	*crc += r;
-	return r;
+	return 0;
 }
 
-static struct record * record_read_ihex(FILE *f)
+static void bench_report(const struct stream *s, const struct hist *lat,
+                         int json)
 {
-	struct record *r, *head = NULL, **tail = &head;
-	char *data = NULL;
-	size_t dsize = 0;
-	ssize_t ret;
-	uint8_t crc = 0, crc_ref, type;
-	unsigned size, line, j; /* ignore unnecessary gcc warning about 'line' being clobbered by longjmp */
-	int jmpr;
-
-	for (line = 1; (ret = getline(&data, &dsize, f)) > 0; line++) {
-		if (ret < 11) {
-			fprintf(stderr, "warning: "
-				"skipping invalid line %u: too short\n",
-				line);
-			continue;
-		}
-		if (data[0] != ':') {
-			fprintf(stderr, "warning: skipping invalid line %u\n",
-				line);
-			continue;
-		}
-		if ((j = strspn(data + 1, "0123456789ABCDEFabcdef")) < 8) {
-			fprintf(stderr,
-				"ihex contains invalid data on line %u: '%c'\n",
-				line, data[1+j]);
-			break;
-		}
-		size     = hex(data + 1, &crc);
-		if (size > ret - 11) {
-			fprintf(stderr,
-				"ihex contains invalid line %u: size (%u) > "
-				"data length (%zd)\n",
-				line, size, ret - 11);
-			break;
-		}
-		r        = malloc(offsetof(struct record, data) + size);
-		*tail    = r;
-		tail     = &r->next;
-		r->next  = NULL;
-		r->size  = size;
-		r->addr  = hex(data + 3, &crc) << 8;
-		r->addr |= hex(data + 5, &crc);
-		type     = hex(data + 7, &crc);
-
-		if ((jmpr = setjmp(ihex_jmp_buf))) {
-			fprintf(stderr,
-				"ihex contains invalid data on line %u: '%c'\n",
-				line, jmpr & 0xff);
-			break;
-		}
-
-		for (j=0; j<size; j++)
-			r->data[j] = hex(data + 9 + (j+j), &crc);
-
-		crc_ref = hex(data + 9 + (j+j), &crc);
-		if (crc) {
-			fprintf(stderr,
-				"CRC failure on line %u: expected 0x%02hhx, "
-				"got: 0x%02x\n",
-				line, crc_ref, (crc - crc_ref) & 0xff);
-			break;
-		}
-
-		/* ordinary record, no offsets / segmented memory supported */
-		if (!type)
-			continue;
-		/* EOF record */
-		if (type == 1)
-			goto done;
-		/* unknown record */
-		fprintf(stderr, "unsupported record type 0x%02hhx on line %u\n",
-			type, line);
-		break;
-	}
+	static const double p[] = { .5, .9, .99, .999, };
+	static const char *pn[] = { "p50", "p90", "p99", "p99.9", };
+	double dt = (s->t_end - s->t_start) * 1e-9;
+	double mbps = dt > 0 ? s->bytes / dt * 1e-6 : 0;
+	unsigned i;
 
-	/* failure case */
-	while (head) {
-		r = head->next;
-		free(head);
-		head = r;
+	if (json) {
+		printf("{\"ep\":%u,\"dir\":\"%s\",\"size\":%u,\"depth\":%u,"
+		       "\"seconds\":%.6f,\"transfers\":%" PRIu64 ","
+		       "\"bytes\":%" PRIu64 ",\"mb_per_s\":%.3f,"
+		       "\"errors\":%" PRIu64 ",\"timeouts\":%" PRIu64 ","
+		       "\"latency_us\":{\"min\":%.3f",
+		       s->ep, s->ep & 0x80 ? "in" : "out", s->len, s->depth,
+		       dt, s->completed, s->bytes, mbps, s->errors,
+		       s->timeouts, lat->min * 1e-3);
+		for (i=0; i<ARRAY_SIZE(p); i++)
+			printf(",\"%s\":%.3f", pn[i],
+			       hist_percentile(lat, p[i]) * 1e-3);
+		printf(",\"max\":%.3f}}\n", lat->max * 1e-3);
+		return;
 	}
 
-done:
-	free(data);
-	return head;
+	printf("ep 0x%02x %s, %u bytes x %u in flight, %.3f s\n",
+	       s->ep, s->ep & 0x80 ? "IN" : "OUT", s->len, s->depth, dt);
+	printf("  transfers: %" PRIu64 ", bytes: %" PRIu64 ", %.2f MB/s\n",
+	       s->completed, s->bytes, mbps);
+	printf("  errors: %" PRIu64 ", timeouts: %" PRIu64 "\n",
+	       s->errors, s->timeouts);
+	printf("  latency [us]: min %.1f", lat->min * 1e-3);
+	for (i=0; i<ARRAY_SIZE(p); i++)
+		printf(", %s %.1f", pn[i], hist_percentile(lat, p[i]) * 1e-3);
+	printf(", max %.1f\n", lat->max * 1e-3);
 }
 
-/* read cyfw */
-
-static uint32_t le32toh(const uint8_t *v)
-{
-	uint32_t r;
-	r  = v[0];
-	r |= v[1] <<  8;
-	r |= v[2] << 16;
-	r |= v[3] << 24;
-	return r;
-}
-
-static struct record * record_read_cyfw(FILE *f)
-{
-	struct record *r, *head = NULL, **tail = &head;
-	uint32_t i, size, addr, crc = 0, crc_ref;
-	uint8_t v[8];
-	uint8_t bImageCTL, bImageType;
-	int u;
-
-	if (getc(f) != 'C' || getc(f) != 'Y') {
-		fprintf(stderr, "input does not begin with magic 'CY'\n");
-		return NULL;
-	}
+static int usb_benchmark(
+	libusb_context *ctx, libusb_device_handle *hdev,
+	const struct bench *b, int json
+) {
+	struct stream s = STREAM_INIT(hdev, b->ep, b->len, b->depth,
+	                              DEFAULT_BENCH_TIMEOUT, -1);
+	struct hist lat;
+	unsigned i, j;
+	int iface, alt, r;
 
-	if ((u = getc(f)) == EOF)
-		goto eof;
-	// fw->i2c_conf = u;
-	if ((u = getc(f)) == EOF)
-		goto eof;
-	// fw->img_type = u;
-
-	while (1) {
-		if (!fread(v, 8, 1, f))
-			goto eof;
-		size = le32toh(v);
-		addr = le32toh(v + 4);
-		if (addr & 0x03)
-			fprintf(stderr,
-				"warning: address 0x%08x is not 32-bit "
-				"aligned\n", addr);
-		r = malloc(offsetof(struct record, data) + size * 4);
-		*tail = r;
-		tail = &r->next;
-		r->next = NULL;
-		r->addr = addr;
-		r->size = size * 4;
-		if (!size)
-			break;
-		if (!fread(r->data, size * 4, 1, f))
-			goto eof;
-		for (i=0; i<size; i++)
-			crc += le32toh(r->data + 4 * i);
-	}
-	if (!fread(v, 4, 1, f))
-		goto eof;
-	crc_ref = le32toh(v); /* checksum */
-	if (crc != crc_ref) {
-		fprintf(stderr,
-			"checksum failure: expected %08x, got %08x\n",
-			crc_ref, crc);
-		goto fail;
+	if (usb_common_find_ep(hdev, b->ep, &iface, &alt))
+		return 1;
+	if ((r = libusb_claim_interface(hdev, iface))) {
+		fprintf(stderr, "error claiming interface %d: %s\n",
+			iface, libusb_error_name(r));
+		return 1;
 	}
-	if (getc(f) != EOF)
+	if (alt && (r = libusb_set_interface_alt_setting(hdev, iface, alt))) {
 		fprintf(stderr,
-			"warning: ignoring garbage at the end of firmware data "
-			"at input position %ld\n", ftell(f) - 1);
-	return head;
-
-eof:
-	if (feof(f))
-		fprintf(stderr, "premature EOF while reading input\n");
-	else
-		fprintf(stderr, "error reading input: %s\n",
-			strerror(ferror(f)));
-fail:
-	while (head) {
-		r = head->next;
-		free(head);
-		head = r;
-	}
-	return NULL;
-}
-
-static struct record * record_read_bin(FILE *f)
-{
-	struct stat st;
-	int fd;
-	struct record *r;
-
-	fd = fileno(f);
-	if (fd == -1) {
-		perror("invalid input file handle");
-		return NULL;
-	}
-	if (fstat(fd, &st) == -1) {
-		perror("stat");
-		return NULL;
+			"error setting alt-setting %d on interface %d: %s\n",
+			alt, iface, libusb_error_name(r));
+		r = 1;
+		goto out;
 	}
 
-	r = malloc(offsetof(struct record, data) + st.st_size);
-	r->next = NULL;
-	r->addr = 0;
-	r->size = st.st_size;
-	if (!fread(r->data, st.st_size, 1, f)) {
-		perror("reading input file");
-		free(r);
-		return NULL;
+	hist_init(&lat);
+	s.fill = bench_fill;
+	s.drain = bench_drain;
+	s.lat = &lat;
+	s.duration = b->secs;
+	s.keep_going = 1;
+	if (stream_init(&s)) {
+		r = 1;
+		goto out;
 	}
+	for (i=0; i<s.depth; i++)
+		for (j=0; j<s.len; j++)
+			s.tfers[i]->buffer[j] = j;
+
+	fprintf(stderr, "benchmarking ep 0x%02x on interface %d alt %d "
+		"for %g s...\n", b->ep, iface, alt, b->secs);
+	r = stream_run(ctx, &s);
+	bench_report(&s, &lat, json);
+	stream_fini(&s);
+
+out:
+	libusb_release_interface(hdev, iface);
 	return r;
 }
 
-/* USB helper functions */
-
-static int usb_query_device_fw(libusb_device_handle *hdev, unsigned timeout)
-{
-	int res;
-	uint8_t v;
-	res = libusb_control_transfer(hdev,
-		0xc0, 0xa0, 0, 0, (uint8_t *)&v, sizeof(v),
-		timeout);
-	if (res < 0) {
-		fprintf(stderr, "error checking device boot-loader type: %s\n",
-			libusb_error_name(res));
-	} else if ((unsigned)res == sizeof(v)) {
-		return v;
-	} else {
-		fprintf(stderr,
-			"short read while checking device boot-loader type: "
-			"received: %u, requested: %zu\n", res, sizeof(v));
-	}
-	return -1;
-}
-
-static int usb_control_tfer(
-	libusb_device_handle *hdev, int ep, int req, struct record *rec,
-	uint32_t *tferd, unsigned timeout
+/* waits for the loaded firmware to renumerate, prints its new bus.addr */
+static int fxprog_wait_renum(
+	const struct usb_common *uc, const addr_t vid_pid, unsigned timeout
 ) {
-	uint8_t *data = rec->data;
-	uint32_t addr = rec->addr;
-	uint32_t size = rec->size;
-	int res = 0;
+	struct usb_renum rn;
+	addr_t old = {
+		libusb_get_bus_number(uc->dev),
+		libusb_get_device_address(uc->dev),
+	};
+	int r = usb_common_wait_renum(old, vid_pid, mono_ns(), timeout, &rn);
 
-	do {
-		uint16_t sz = size > 0x1000 ? 0x1000 : size;
-		fprintf(stderr,
-			"submitting %02x %02x val: %04x idx: %04x len: %04x\n",
-			ep, req, addr & 0xffff, addr >> 16, sz);
-		res = libusb_control_transfer(hdev,
-			ep, req, addr & 0xffff, addr >> 16, data, sz, timeout);
-		if (res < 0) {
-			fprintf(stderr, "error %s control transfer data: %s\n",
-				ep & 0x80 ? "receiving" : "sending",
-				libusb_error_name(res));
-			res = 1;
-			break;
-		}
-		if ((unsigned)res < sz) {
-			fprintf(stderr,
-				"short %s %d < %u while transferring data\n",
-				ep & 0x80 ? "read" : "write", res, sz);
-			res = 2;
-			break;
-		}
-		res = 0;
-		size -= sz;
-		addr += sz;
-		data += sz;
-	} while (size);
-
-	if (tferd)
-		*tferd = rec->size - size;
-	return res;
+	if (r)
+		return r == 2 ? 4 : 1;
+	fprintf(stderr, "renumerated as %04hx:%04hx on bus.addr %hu.%hu: ",
+		vid_pid[0], vid_pid[1], rn.bus_addr[0], rn.bus_addr[1]);
+	if (rn.t_gone)
+		fprintf(stderr, "gone after %.1f ms, ", rn.t_gone * 1e-6);
+	fprintf(stderr, "back after %.1f ms, ready after %.1f ms\n",
+		rn.t_arrived * 1e-6, rn.t_ready * 1e-6);
+	printf("%hu.%hu\n", rn.bus_addr[0], rn.bus_addr[1]);
+	return 0;
 }
 
-static int usb_upload_records(
-	libusb_device_handle *hdev,
-	struct record *head,
-	unsigned timeout
+/* Writes image in to out in format out_fmt. The input is parsed into a single
+ * list of records, the output is written while iterating over it. */
+static int fxprog_convert(
+	const char *in, unsigned in_fmt, int sort, int merge, const char *out,
+	unsigned out_fmt, struct fw_out *o
 ) {
-	struct record *r;
-	unsigned irec;
-	int res = 0;
-
-	fprintf(stderr, "query: 0x%02x\n", usb_query_device_fw(hdev, timeout));
-
-	for (r = head, irec = 0; r; r = r->next, irec++) {
-		res = usb_control_tfer(hdev, 0x40, USB_REQ_FIRMWARE_LOAD, r, NULL, DEFAULT_TIMEOUT);
-		if (res) {
-			fprintf(stderr, "error uploading firmware record %u\n",
-				irec);
-			break;
-		}
-	}
+	struct record *recs = fw_read(in, in_fmt), *r;
+	int res;
 
-	return res;
+	if (!recs)
+		return 2;
+	/* the input's entry point is its last record of size 0, take it before
+	 * merging folds it into a neighbour */
+	if (o->entry < 0)
+		for (r = recs; r; r = r->next)
+			if (!r->size)
+				o->entry = r->addr;
+	if (sort)
+		recs = record_sort(recs);
+	if (merge)
+		recs = record_merge_adj(recs);
+	res = fw_write(out, out_fmt, recs, o);
+	record_free_all(recs);
+	return res ? 3 : 0;
 }
 
 /* main */
 
+static void on_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		stream_report_req = 1;
+	else
+		hotplug_quit = 1;
+}
+
 static void print_help(const char *prog_name, const struct usb_common *uc);
 static void print_help_cfg_byte(void);
 
@@ -434,7 +211,8 @@ enum mode {
 	RAM_UPLOAD,
 	RAM_DOWNLOAD,
 	QUERY,
-	/* todo: send data, recv data, benchmark IN/OUT ep(s) */
+	BENCHMARK,
+	/* todo: send data, recv data */
 };
 
 static int str_find(
@@ -472,11 +250,23 @@ int main(int argc, char **argv)
 	const char *in   = NULL;
 	const char *dump = NULL;
 	const char *load = NULL;
+	const char *bench = NULL;
+	const char *manifest = NULL;
+	const char *renum = NULL;
+	const char *profile = NULL;
+	const char *tune = NULL;
+	const char *out = NULL;
+	const char *entry = NULL;
+	struct hotplug_img autoprog[N_DEV_TYPES];
+	unsigned n_autoprog = 0;
 
 	int cpu_reset = 1;
 	int query = 0;
 	int sort = 0;
 	int merge = 1;
+	int json = 0;
+	unsigned ctrl_depth = DEFAULT_CTRL_DEPTH;
+	unsigned workers = DEFAULT_FLEET_WORKERS;
 
 	uint8_t i2c_conf = DEFAULT_I2C_CONF;
 	uint8_t img_type = DEFAULT_IMG_TYPE;
@@ -487,7 +277,7 @@ int main(int argc, char **argv)
 	if (r)
 		return 1;
 
-	while ((opt = getopt(argc, argv, ":qf:F:d:i:rmsl:I:T:hH")) != -1) {
+	while ((opt = getopt(argc, argv, ":qf:F:d:i:rmsl:I:T:o:e:b:jQ:M:W:a:w:C:A:hH")) != -1) {
 		switch (opt) {
 		case 'q': query     = 1; break;
 		case 'f': sin_fmt   = optarg; break;
@@ -500,6 +290,21 @@ int main(int argc, char **argv)
 		case 'l': load      = optarg; break;
 		case 'I': i2c_conf  = strtoul(optarg, NULL, 0) & 0xffU; break;
 		case 'T': img_type  = strtoul(optarg, NULL, 0) & 0xffU; break;
+		case 'o': out       = optarg; break;
+		case 'e': entry     = optarg; break;
+		case 'b': bench     = optarg; break;
+		case 'j': json      = 1; break;
+		case 'Q': ctrl_depth = strtoul(optarg, NULL, 0); break;
+		case 'M': manifest  = optarg; break;
+		case 'w': renum     = optarg; break;
+		case 'C': profile   = optarg; break;
+		case 'A': tune      = optarg; break;
+		case 'W': workers   = strtoul(optarg, NULL, 0); break;
+		case 'a':
+			if (n_autoprog == ARRAY_SIZE(autoprog))
+				FATAL(1,"too many auto-programming images (-a)\n");
+			autoprog[n_autoprog++].path = optarg;
+			break;
 		case 'h':
 			print_help(argv[0], &uc);
 			return 0;
@@ -555,84 +360,217 @@ int main(int argc, char **argv)
 		}
 	}
 
+	struct bench b = {
+		0, DEFAULT_BENCH_LEN, DEFAULT_BENCH_DEPTH, DEFAULT_BENCH_SECS,
+	};
+
+	if (bench) {
+		char *endptr;
+		unsigned long ep = strtoul(bench, &endptr, 0);
+		if (*endptr == ':')
+			b.len = strtoul(endptr + 1, &endptr, 0);
+		if (*endptr == ':')
+			b.depth = strtoul(endptr + 1, &endptr, 0);
+		if (*endptr == ':')
+			b.secs = strtod(endptr + 1, &endptr);
+		if (*endptr || ep > 0xff || (ep & 0x0f) == 0 || !b.len ||
+		    !b.depth || b.secs <= 0)
+			FATAL(1,"invalid benchmark syntax (-b): %s\n",bench);
+		b.ep = ep;
+		if (dump || in || load)
+			FATAL(1,"benchmark mode cannot be combined with loading "
+			        "or dumping RAM\n");
+	}
+
+	if (!ctrl_depth)
+		FATAL(1,"control request depth (-Q) must be positive\n");
+
+	struct load_profile prof = { 0, 0 };	/* 0: from the profile */
+
+	if (profile) {
+		char *endptr;
+		prof.chunk = strtoul(profile, &endptr, 0);
+		if (*endptr == ':')
+			prof.timeout = strtoul(endptr + 1, &endptr, 0);
+		if (*endptr || !prof.chunk || prof.chunk > MAX_LOAD_CHUNK)
+			FATAL(1,"invalid request profile syntax (-C): %s\n",
+			      profile);
+	}
+
+	long tune_addr = 0, tune_size = 0;
+	unsigned tune_max = DEFAULT_LOAD_CHUNK;
+
+	if (tune) {
+		char *endptr;
+		tune_addr = strtol(tune, &endptr, 0);
+		if (*endptr == '+')
+			tune_size = strtol(endptr + 1, &endptr, 0);
+		if (*endptr == ':')
+			tune_max = strtoul(endptr + 1, &endptr, 0);
+		if (*endptr || tune_addr < 0 || tune_size < 64 ||
+		    tune_max < 64 || tune_max > MAX_LOAD_CHUNK)
+			FATAL(1,"invalid auto-tune syntax (-A): %s\n",tune);
+		if (dump || in || load || bench || manifest || n_autoprog)
+			FATAL(1,"auto-tuning (-A) cannot be combined with other "
+			        "modes of operation\n");
+	}
+
+	struct fw_out out_cfg = { i2c_conf, img_type, -1, };
+
+	if (entry) {
+		char *endptr;
+		unsigned long e = strtoul(entry, &endptr, 0);
+		if (*endptr || e > UINT32_MAX)
+			FATAL(1,"invalid entry point (-e): %s\n",entry);
+		out_cfg.entry = e;
+	}
+
+	if (out) {
+		if (!in || dump || load || bench || tune || renum || manifest ||
+		    n_autoprog || query)
+			FATAL(1,"converting (-o) needs an input image (-i) and "
+			        "cannot be combined with other modes of "
+			        "operation\n");
+		return fxprog_convert(in, in_fmt, sort, merge, out, dump_fmt,
+		                      &out_cfg);
+	}
+
+	addr_t renum_vid_pid;
+	unsigned renum_timeout = DEFAULT_RENUM_TIMEOUT;
+
+	if (renum) {
+		int n = -1;
+		sscanf(renum, "%4hx:%4hx%n:%u%n", &renum_vid_pid[0],
+		       &renum_vid_pid[1], &n, &renum_timeout, &n);
+		if (n < 0 || renum[n])
+			FATAL(1,"invalid renumeration syntax (-w): %s\n",renum);
+		if (!in || dump || manifest || n_autoprog)
+			FATAL(1,"waiting for renumeration (-w) needs firmware to "
+			        "be loaded onto a single device (-i)\n");
+	}
+
+	for (i=0; i<n_autoprog; i++) {
+		/* <type>:<image> */
+		struct hotplug_img *a = &autoprog[i];
+		const char *sep = strchr(a->path, ':');
+		unsigned j, k;
+		if (!sep)
+			FATAL(1,"invalid auto-programming syntax (-a): %s\n",
+			      a->path);
+		for (j=0; j<ARRAY_SIZE(dev_types); j++)
+			if (strlen(dev_types[j].name) == (size_t)(sep - a->path) &&
+			    !strncmp(dev_types[j].name, a->path, sep - a->path))
+				break;
+		if (j == ARRAY_SIZE(dev_types))
+			FATAL(1,"unknown device type (-a): %.*s\n",
+			      (int)(sep - a->path), a->path);
+		for (k=0; k<i; k++)
+			if (autoprog[k].type == &dev_types[j])
+				FATAL(1,"device type %s given twice (-a)\n",
+				      dev_types[j].name);
+		a->type = &dev_types[j];
+		a->path = sep + 1;
+		a->fmt = in_fmt;
+	}
+
+	if (manifest) {
+		struct fleet_opts fo = {
+			in_fmt, sort, merge, workers, ctrl_depth,
+			prof.timeout, prof.chunk, dev_types, ARRAY_SIZE(dev_types),
+			&dev_types[DEV_FX2],
+		};
+		if (dump || in || load || bench || query || n_autoprog)
+			FATAL(1,"fleet mode (-M) cannot be combined with other "
+			        "modes of operation\n");
+		if (!workers)
+			FATAL(1,"number of workers (-W) must be positive\n");
+		return fleet_run(manifest, &fo);
+	}
+
+	if (n_autoprog) {
+		struct hotplug_opts ho = {
+			autoprog, n_autoprog, sort, merge, workers, ctrl_depth,
+			prof.timeout, prof.chunk, &dev_types[DEV_FX2],
+		};
+		if (dump || in || load || bench || query)
+			FATAL(1,"auto-programming (-a) cannot be combined with "
+			        "other modes of operation\n");
+		if (!workers)
+			FATAL(1,"number of workers (-W) must be positive\n");
+		sigaction(SIGINT, &(struct sigaction){
+			.sa_handler = on_signal,
+		}, NULL);
+		sigaction(SIGTERM, &(struct sigaction){
+			.sa_handler = on_signal,
+		}, NULL);
+		sigaction(SIGUSR1, &(struct sigaction){
+			.sa_handler = on_signal, .sa_flags = SA_RESTART,
+		}, NULL);
+		return hotplug_run(&ho);
+	}
+
 	r = usb_common_setup(&uc);
 	if (r)
 		return r;
 
-	if (query) {
+	load_profile_get(&prof, uc.spec.dev_type, uc.dev);
+	if (in || dump || tune)
+		fprintf(stderr, "requests of up to %u bytes, timeout %u ms\n",
+			prof.chunk, prof.timeout);
+	struct ctrlq cq = CTRLQ_INIT(uc.hdev, ctrl_depth, prof.timeout);
+	if (ctrlq_init(&cq)) {
+		r = 2;
+		goto out2;
+	}
+
+	if (bench) {
+		r = usb_benchmark(uc.ctx, uc.hdev, &b, json);
+	} else if (query) {
 		int q = usb_query_device_fw(uc.hdev, DEFAULT_TIMEOUT);
 		/* FX3 -> 0x1b (hard reset - power off)
 		 *        0x28 (soft reset - reset switch after having been programmed at least once)
 		 * FX2 -> 0x00 */
 		if (q >= 0)
 			printf("0x%02x\n", q);
+	} else if (tune) {
+		/* the FX2's CPU must not run while its RAM is overwritten */
+		if (uc.spec.dev_type == &dev_types[DEV_FX2])
+			libusb_control_transfer(uc.hdev, 0x40,
+				USB_REQ_FIRMWARE_LOAD, FX2_REG_CPUCS, 0x0000,
+				(uint8_t[]){0x01}, 1, prof.timeout);
+		if (load_tune(uc.ctx, &cq, tune_addr, tune_size, tune_max,
+		              &prof, stdout)) {
+			fprintf(stderr, "no chunk size worked\n");
+			r = 3;
+		} else if (load_tune_store(uc.dev, &prof)) {
+			r = 3;
+		}
 	} else if (dump) {
 		/* dump RAM [dump_from,dump_from+dump_num) */
 		struct record *rec = record_create(dump_from, dump_num);
-		usb_control_tfer(uc.hdev, 0xc0, USB_REQ_FIRMWARE_LOAD, rec, &rec->size, DEFAULT_TIMEOUT);
-		fwrite(rec->data, rec->size, 1, stdout);
+		usb_control_tfer(uc.ctx, &cq, 0xc0, USB_REQ_FIRMWARE_LOAD, prof.chunk, rec, &rec->size);
+		if (fw_write("-", dump_fmt, rec, &out_cfg))
+			r = 3;
 		free(rec);
 	} else if (in) {
 		/* load RAM or FW */
-		struct record *recs, *cpu_reset;
-		FILE *fw_fd = fopen(in, "r");
-		if (!fw_fd) {
-			perror(in);
-			goto out2;
-		}
-		recs = in_fmts[in_fmt].read(fw_fd);
-		fclose(fw_fd);
+		struct record *recs = fw_cache_read(in, in_fmt, sort, merge);
 		if (!recs)
 			goto out2;
-		if (sort)
-			recs = record_sort(recs);
-		if (merge)
-			recs = record_merge_adj(recs);
-
-#if 0
-		cpu_reset = NULL;
-		if (uc.spec.dev_type && dev_types - uc.spec.dev_type == DEV_FX2) {
-			cpu_reset = record_create(FX2_REG_CPUCS, 1);
-			cpu_reset->data[0] = 0x01;
-			fprintf(stderr, "resetting CPU...\n");
-			usb_upload_records(hdev, cpu_reset, DEFAULT_TIMEOUT);
-			
-		}
 
-		usb_upload_records(hdev, recs, DEFAULT_TIMEOUT);
+		int res = usb_load_firmware(uc.ctx, &cq,
+			uc.spec.dev_type && dev_types - uc.spec.dev_type == DEV_FX2,
+			prof.chunk, recs);
 
-		if (uc.spec.dev_type && dev_types - uc.spec.dev_type == DEV_FX2) {
-			cpu_reset->data[0] = 0x00;
-			fprintf(stderr, "resuming CPU...\n");
-			usb_upload_records(hdev, cpu_reset, DEFAULT_TIMEOUT);
-			free(cpu_reset);
-		}
-#else
-		if (uc.spec.dev_type && dev_types - uc.spec.dev_type == DEV_FX2) {
-			fprintf(stderr, "resetting CPU...\n");
-			libusb_control_transfer(uc.hdev, 0x40, USB_REQ_FIRMWARE_LOAD,
-				FX2_REG_CPUCS, 0x0000, (uint8_t[]){0x01}, 1,
-				DEFAULT_TIMEOUT);
-		}
-
-		usb_upload_records(uc.hdev, recs, DEFAULT_TIMEOUT);
-
-		if (uc.spec.dev_type && dev_types - uc.spec.dev_type == DEV_FX2) {
-			fprintf(stderr, "resuming CPU...\n");
-			libusb_control_transfer(uc.hdev, 0x40, USB_REQ_FIRMWARE_LOAD,
-				FX2_REG_CPUCS, 0x0000, (uint8_t[]){0x00}, 1,
-				DEFAULT_TIMEOUT);
-		}
-#endif
-
-		while (recs) {
-			struct record *next = recs->next;
-			free(recs);
-			recs = next;
-		}
+		record_free_all(recs);
+		if (res && renum)
+			r = 3;	/* there is nothing to wait for */
+		else if (renum)
+			r = fxprog_wait_renum(&uc, renum_vid_pid, renum_timeout);
 	}
 
 out2:
+	ctrlq_fini(&cq);
 	usb_common_teardown(&uc);
 	return r;
 }
@@ -653,9 +591,14 @@ static void print_help(const char *prog_name, const struct usb_common *uc)
 	printf("  ep_get  <ep> [<size>]                    -- dump data read from an endpoint\n");
 	printf("  ep_put  <ep> [-i <in.bin>]               -- push data to an endpoint\n");
 */
-	printf("load RAM w/ firmware      : [-f <fmt>] [-i <fw.dat>] [-r]\n");
+	printf("load RAM w/ firmware      : [-f <fmt>] [-i <fw.dat>] [-r] [-w <vid>:<pid>[:<ms>]]\n");
 	printf("load RAM w/ arbitrary data: -l <addr> [-i <in.bin>]\n");
 	printf("dump RAM                  : [-F <fmt>] -d <addr>{:<to>|+<size>}\n");
+	printf("convert image             : [-f <fmt>] -i <fw.dat> [-F <fmt>] [-I <i2c-conf>] [-T <img-type>] [-e <addr>] -o <out>\n");
+	printf("benchmark endpoint        : [-j] -b <ep>[:<size>[:<depth>[:<sec>]]]\n");
+	printf("tune request size         : [-C <chunk>[:<ms>]] -A <addr>+<size>[:<max>]\n");
+	printf("load many devices         : [-f <fmt>] [-W <workers>] -M <manifest>\n");
+	printf("load devices on arrival   : [-f <fmt>] [-W <workers>] -a <type>:<fw.dat> ...\n");
 	printf("\n");
 	printf("%s", uc_help);
 	printf("  -q              query device for boot-loader fw type\n");
@@ -665,13 +608,26 @@ static void print_help(const char *prog_name, const struct usb_common *uc)
 		printf(" %s%c", in_fmts[i].name,
 			i < ARRAY_SIZE(in_fmts) - 1
 			? ',' : '\n');
-	printf("  -i <fw.dat>     data to write to the USB device\n");
+	printf("  -i <fw.dat>     data to write to the USB device; the parsed, sorted and\n");
+	printf("                  merged records of files are cached in $" ENV_FW_CACHE "\n");
+	printf("                  (default: ~/" DEFAULT_FW_CACHE ", empty: off)\n");
 	printf("  -r              don't reset CPU while loading the FW\n");
+	printf("  -w <vid>:<pid>[:<timeout_ms>]\n");
+	printf("                  after loading, wait until the device has renumerated as\n");
+	printf("                  <vid>:<pid> and can be opened (default timeout: %d ms, exit\n", DEFAULT_RENUM_TIMEOUT);
+	printf("                  status 4 when it expires); its new <bus>.<addr> is printed\n");
+	printf("                  to stdout, the time from load to renumeration to stderr\n");
 	printf("  -m              don't merge adjacent to-be-transferred entries\n");
 	printf("  -s              do sort entries prior to merging / transmission\n");
-	printf("  -I <i2c-conf>   i2c configuration byte (unchecked), default: 0x%02x\n", DEFAULT_I2C_CONF);
-	printf("  -T <img-type>   image type configuration byte (unchecked), default: 0x%02x\n", DEFAULT_IMG_TYPE);
-	printf("  -F <format>     format to dump RAM contents, default: " DEFAULT_DUMP_FMT "\n");
+	printf("  -I <i2c-conf>   i2c configuration byte (unchecked) of written cyfw images,\n");
+	printf("                  default: 0x%02x\n", DEFAULT_I2C_CONF);
+	printf("  -T <img-type>   image type configuration byte (unchecked) of written cyfw\n");
+	printf("                  images, default: 0x%02x\n", DEFAULT_IMG_TYPE);
+	printf("  -o <out>        convert the input image (-i) to format -F and write it to\n");
+	printf("                  <out> ('-' for stdout) instead of loading it\n");
+	printf("  -e <addr>       program entry point of written images, default: the input's\n");
+	printf("                  (ihex start address or cyfw entry), required for cyfw\n");
+	printf("  -F <format>     format to dump RAM contents or convert to, default: " DEFAULT_DUMP_FMT "\n");
 	printf("                  supported:");
 	for (i=0; i<ARRAY_SIZE(dump_fmts); i++)
 		printf(" %s%c", dump_fmts[i].name,
@@ -680,6 +636,41 @@ static void print_help(const char *prog_name, const struct usb_common *uc)
 	printf("  -d <addr>{:<to>|+<size>}\n") ;
 	printf("                  dump RAM contents from <addr> to (excl.) either <to> or\n");
 	printf("                  <addr>+<size> as binary data to stdout\n");
+	printf("  -b <ep>[:<size>[:<depth>[:<sec>]]]\n");
+	printf("                  benchmark bulk endpoint <ep> for <sec> seconds (default: %d)\n", DEFAULT_BENCH_SECS);
+	printf("                  keeping <depth> transfers (default: %d) of <size> bytes\n", DEFAULT_BENCH_DEPTH);
+	printf("                  (default: %d) in flight; IN data is discarded, OUT data\n", DEFAULT_BENCH_LEN);
+	printf("                  synthesized\n");
+	printf("  -j              print benchmark results as JSON\n");
+	printf("  -Q <depth>      keep up to <depth> control requests in flight while loading\n");
+	printf("                  (across records) or dumping RAM (default: %d); -Q 1 waits\n", DEFAULT_CTRL_DEPTH);
+	printf("                  for each request like synchronous transfers do\n");
+	printf("  -C <chunk>[:<timeout_ms>]\n");
+	printf("                  size and timeout of each request loading or dumping RAM;\n");
+	printf("                  default: tuned for the device's VID:PID (see -A), else\n");
+	printf("                  per device type:");
+	for (i=0; i<ARRAY_SIZE(dev_types); i++)
+		printf(" %s %u:%u%c", dev_types[i].name, dev_types[i].chunk,
+			dev_types[i].timeout,
+			i < ARRAY_SIZE(dev_types) - 1 ? ',' : '\n');
+	printf("  -A <addr>+<size>[:<max>]\n");
+	printf("                  measure load and dump throughput on the scratch RAM region\n");
+	printf("                  <addr>+<size> for chunk sizes 64..<max> (default: %d) and\n", DEFAULT_LOAD_CHUNK);
+	printf("                  store the best one for the device's VID:PID in $" ENV_LOAD_TUNE "\n");
+	printf("                  (default: ~/" DEFAULT_LOAD_TUNE ")\n");
+	printf("  -M <manifest>   load firmware onto all devices listed in <manifest> ('-' for\n");
+	printf("                  stdin), one \"{<bus>.<addr>|<vid>:<pid>} <image> [<fmt>]\" per\n");
+	printf("                  line; each image is parsed once, a result table is printed\n");
+	printf("  -W <workers>    number of devices loaded concurrently with -M or -a\n");
+	printf("                  (default: %d)\n", DEFAULT_FLEET_WORKERS);
+	printf("  -a <type>:<fw.dat>\n");
+	printf("                  stay resident and load <fw.dat> onto each device of <type>\n");
+	printf("                  (");
+	for (i=0; i<ARRAY_SIZE(dev_types); i++)
+		printf("%s%s", dev_types[i].name,
+			i < ARRAY_SIZE(dev_types) - 1 ? ", " : "");
+	printf(") as soon as it appears; may be repeated. Logs the\n");
+	printf("                  time from arrival to programmed, statistics on SIGUSR1\n");
 	printf("  -h              print this help message\n");
 	printf("  -H              print details about the i2c and image type configuration bytes\n");
 
@@ -0,0 +1,65 @@
+
+#include <string.h>
+
+#include "hist.h"
+
+void hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(struct hist *h, const struct hist *o)
+{
+	unsigned i;
+
+	if (!o->count)
+		return;
+	for (i=0; i<HIST_N_BUCKETS; i++)
+		h->b[i] += o->b[i];
+	if (!h->count || o->min < h->min)
+		h->min = o->min;
+	if (o->max > h->max)
+		h->max = o->max;
+	h->count += o->count;
+	h->sum += o->sum;
+}
+
+/* upper bound of bucket i, i.e. the largest value mapped to it */
+static uint64_t hist_bucket_max(unsigned i)
+{
+	unsigned g = i >> HIST_SUB_BITS, sub = i & ((1U << HIST_SUB_BITS) - 1);
+	if (!g)
+		return i;
+	return ((uint64_t)((1U << HIST_SUB_BITS) + sub + 1) << (g - 1)) - 1;
+}
+
+/* returns the value below which fraction p (in [0,1]) of samples lie */
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t rank, n = 0, v;
+	unsigned i;
+
+	if (!h->count)
+		return 0;
+	rank = p * h->count;
+	if (rank >= h->count)
+		return h->max;
+	for (i=0; i<HIST_N_BUCKETS; i++)
+		if ((n += h->b[i]) > rank)
+			break;
+	v = hist_bucket_max(i);
+	if (v > h->max)
+		v = h->max;
+	if (v < h->min)
+		v = h->min;
+	return v;
+}
+
+/* prints a summary of h, whose samples are in ns, in us */
+void hist_report(const struct hist *h, const char *name, FILE *f)
+{
+	fprintf(f, "%s latency [us]: n %" PRIu64 ", p50 %.1f, p99 %.1f, "
+		"p99.9 %.1f, max %.1f\n", name, h->count,
+		hist_percentile(h, .5) * 1e-3, hist_percentile(h, .99) * 1e-3,
+		hist_percentile(h, .999) * 1e-3, h->max * 1e-3);
+}
@@ -0,0 +1,44 @@
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+/* Log-bucketed histogram: each power of two is split into 2^HIST_SUB_BITS
+ * linear sub-buckets, bounding the relative error of reported percentiles by
+ * 2^-HIST_SUB_BITS while keeping hist_add() to a few instructions. */
+#define HIST_SUB_BITS		3
+#define HIST_N_BUCKETS		((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+	uint64_t count, sum, min, max;
+	uint64_t b[HIST_N_BUCKETS];
+};
+
+static inline unsigned hist_bucket(uint64_t v)
+{
+	unsigned k;
+	if (v < (1U << HIST_SUB_BITS))
+		return v;
+	k = 63 - __builtin_clzll(v);
+	return ((k - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+	     | ((v >> (k - HIST_SUB_BITS)) & ((1U << HIST_SUB_BITS) - 1));
+}
+
+static inline void hist_add(struct hist *h, uint64_t v)
+{
+	h->b[hist_bucket(v)]++;
+	if (!h->count++ || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->sum += v;
+}
+
+void hist_init(struct hist *h);
+void hist_merge(struct hist *h, const struct hist *o);
+uint64_t hist_percentile(const struct hist *h, double p);
+void hist_report(const struct hist *h, const char *name, FILE *f);
+
+#endif
@@ -0,0 +1,316 @@
+
+#define _POSIX_C_SOURCE		200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "common.h"
+#include "hotplug.h"
+#include "stream.h"		/* stream_report_req */
+#include "hist.h"
+#include "fw.h"
+#include "fwcache.h"
+#include "load.h"
+#include "trace.h"
+
+/* Arrivals are only queued by the hotplug callback, which must not do any
+ * synchronous I/O; the workers open and program the devices, sharing the
+ * context whose events the main thread handles in between. */
+
+volatile sig_atomic_t hotplug_quit;
+
+struct hotplug_type {
+	struct hotplug *hp;
+	const struct hotplug_img *cfg;
+	struct record *recs;
+	uint64_t bytes;
+	libusb_hotplug_callback_handle cb;
+	int registered;
+
+	/* statistics, protected by hotplug.lock */
+	uint64_t n_ok, n_err;
+	struct hist lat;	/* arrival to programmed in ns */
+};
+
+struct hotplug_job {
+	struct hotplug_job *next;
+	libusb_device *dev;
+	struct hotplug_type *type;
+	uint64_t t_arrive;
+};
+
+struct hotplug {
+	const struct hotplug_opts *o;
+	libusb_context *ctx;
+	struct hotplug_type *types;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct hotplug_job *head, **tail;	/* arrivals not picked up yet */
+	int stop;
+};
+
+static int LIBUSB_CALL hotplug_arrived(
+	libusb_context *ctx, libusb_device *dev, libusb_hotplug_event ev,
+	void *arg
+) {
+	struct hotplug_type *t = arg;
+	struct hotplug *hp = t->hp;
+	struct hotplug_job *j = malloc(sizeof(*j));
+
+	if (!j) {
+		fprintf(stderr, "error queueing device %hhu.%hhu\n",
+			libusb_get_bus_number(dev),
+			libusb_get_device_address(dev));
+		return 0;
+	}
+	*j = (struct hotplug_job){
+		NULL, libusb_ref_device(dev), t, mono_ns(),
+	};
+	pthread_mutex_lock(&hp->lock);
+	*hp->tail = j;
+	hp->tail = &j->next;
+	pthread_cond_signal(&hp->cond);
+	pthread_mutex_unlock(&hp->lock);
+	return 0;
+}
+
+static void hotplug_program(struct hotplug *hp, struct hotplug_job *j)
+{
+	const struct hotplug_opts *o = hp->o;
+	struct hotplug_type *t = j->type;
+	struct load_profile p = { o->chunk, o->timeout, };
+	libusb_device_handle *hdev;
+	struct ctrlq cq;
+	const char *what = NULL;
+	uint64_t t_start = mono_ns(), t_end;
+	int r;
+
+	if ((r = libusb_open(j->dev, &hdev))) {
+		what = "open";
+	} else {
+		load_profile_get(&p, t->cfg->type, j->dev);
+		cq = (struct ctrlq)CTRLQ_INIT(hdev, o->depth, p.timeout);
+		if (ctrlq_init(&cq))
+			what = "alloc";
+		else if (usb_load_firmware(hp->ctx, &cq,
+		                           t->cfg->type == o->fx2, p.chunk,
+		                           t->recs))
+			what = "upload";
+		ctrlq_fini(&cq);
+		libusb_close(hdev);
+	}
+	t_end = mono_ns();
+	if (trace_file) {
+		trace_span("hotplug", "queued", j->t_arrive, t_start,
+		           "\"bus\":%u,\"addr\":%u",
+		           libusb_get_bus_number(j->dev),
+		           libusb_get_device_address(j->dev));
+		trace_span("hotplug", "program", t_start, t_end,
+		           "\"bus\":%u,\"addr\":%u,\"ok\":%s",
+		           libusb_get_bus_number(j->dev),
+		           libusb_get_device_address(j->dev),
+		           what ? "false" : "true");
+	}
+
+	pthread_mutex_lock(&hp->lock);
+	if (what) {
+		t->n_err++;
+	} else {
+		t->n_ok++;
+		hist_add(&t->lat, t_end - j->t_arrive);
+	}
+	printf("%hhu.%hhu %s %s %s: queued %.1f ms, load %.1f ms, "
+	       "arrival to programmed %.1f ms\n",
+	       libusb_get_bus_number(j->dev), libusb_get_device_address(j->dev),
+	       t->cfg->type->name, t->cfg->path, what ? what : "ok",
+	       (t_start - j->t_arrive) * 1e-6, (t_end - t_start) * 1e-6,
+	       (t_end - j->t_arrive) * 1e-6);
+	fflush(stdout);
+	pthread_mutex_unlock(&hp->lock);
+
+	libusb_unref_device(j->dev);
+	free(j);
+}
+
+static void * hotplug_worker(void *arg)
+{
+	struct hotplug *hp = arg;
+	struct hotplug_job *j;
+
+	pthread_mutex_lock(&hp->lock);
+	while (1) {
+		while (!hp->head && !hp->stop)
+			pthread_cond_wait(&hp->cond, &hp->lock);
+		if (hp->stop)
+			break;
+		j = hp->head;
+		if (!(hp->head = j->next))
+			hp->tail = &hp->head;
+		pthread_mutex_unlock(&hp->lock);
+		hotplug_program(hp, j);
+		pthread_mutex_lock(&hp->lock);
+	}
+	pthread_mutex_unlock(&hp->lock);
+	return NULL;
+}
+
+static void hotplug_report(struct hotplug *hp, FILE *f)
+{
+	const struct hotplug_type *t;
+	char name[64];
+	unsigned i;
+
+	pthread_mutex_lock(&hp->lock);
+	for (i=0; i<hp->o->n_imgs; i++) {
+		t = &hp->types[i];
+		fprintf(f, "%s %s: %" PRIu64 " programmed, %" PRIu64 " failed\n",
+			t->cfg->type->name, t->cfg->path, t->n_ok, t->n_err);
+		snprintf(name, sizeof(name), "%s arrival to programmed",
+		         t->cfg->type->name);
+		hist_report(&t->lat, name, f);
+	}
+	pthread_mutex_unlock(&hp->lock);
+}
+
+/* parses each image once, before any device is touched */
+static int hotplug_read_images(struct hotplug *hp)
+{
+	const struct hotplug_opts *o = hp->o;
+	struct hotplug_type *t;
+	struct record *rec;
+	unsigned i;
+
+	for (i=0; i<o->n_imgs; i++) {
+		t = &hp->types[i];
+		t->hp = hp;
+		t->cfg = &o->imgs[i];
+		hist_init(&t->lat);
+		if (!(t->recs = fw_cache_read(t->cfg->path, t->cfg->fmt,
+		                              o->sort, o->merge))) {
+			fprintf(stderr, "error reading image %s\n",
+				t->cfg->path);
+			return 1;
+		}
+		for (rec = t->recs; rec; rec = rec->next)
+			t->bytes += rec->size;
+	}
+	return 0;
+}
+
+int hotplug_run(const struct hotplug_opts *o)
+{
+	struct hotplug hp = { .o = o, };
+	struct hotplug_type *t;
+	struct hotplug_job *j;
+	pthread_t *threads = NULL;
+	unsigned i, n_threads = 0;
+	int r;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		fprintf(stderr, "libusb has no hotplug support on this "
+			"platform\n");
+		return 2;
+	}
+	if (!(hp.types = calloc(o->n_imgs, sizeof(*hp.types)))) {
+		r = 2;
+		goto out;
+	}
+	if ((r = hotplug_read_images(&hp)))
+		goto out;
+	if ((r = libusb_init(&hp.ctx))) {
+		fprintf(stderr, "error initializing libusb: %s\n",
+			libusb_error_name(r));
+		hp.ctx = NULL;
+		r = 2;
+		goto out;
+	}
+
+	/* the records are only read from here on */
+	load_verbose = 0;
+	hp.tail = &hp.head;
+	pthread_mutex_init(&hp.lock, NULL);
+	pthread_cond_init(&hp.cond, NULL);
+	threads = calloc(o->workers, sizeof(*threads));
+	for (i=0; threads && i<o->workers; i++, n_threads++)
+		if ((r = pthread_create(&threads[i], NULL, hotplug_worker, &hp))) {
+			fprintf(stderr, "error starting worker: %s\n",
+				strerror(r));
+			break;
+		}
+	r = 0;
+	if (!n_threads) {
+		/* the main thread is busy handling events */
+		r = 2;
+		goto out2;
+	}
+
+	/* LIBUSB_HOTPLUG_ENUMERATE: queue devices already attached, too */
+	for (i=0; i<o->n_imgs; i++) {
+		t = &hp.types[i];
+		if ((r = libusb_hotplug_register_callback(hp.ctx,
+		                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+		                LIBUSB_HOTPLUG_ENUMERATE,
+		                t->cfg->type->addr[0], t->cfg->type->addr[1],
+		                LIBUSB_HOTPLUG_MATCH_ANY, hotplug_arrived, t,
+		                &t->cb))) {
+			fprintf(stderr, "error registering hotplug callback: "
+				"%s\n", libusb_error_name(r));
+			r = 2;
+			goto out2;
+		}
+		t->registered = 1;
+		fprintf(stderr, "programming %s devices %04hx:%04hx with %s "
+			"(%" PRIu64 " bytes)\n", t->cfg->type->name,
+			t->cfg->type->addr[0], t->cfg->type->addr[1],
+			t->cfg->path, t->bytes);
+	}
+
+	while (!hotplug_quit) {
+		r = libusb_handle_events_timeout(hp.ctx,
+			&(struct timeval){ 0, 100000 });
+		if (r && r != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "error handling USB events: %s\n",
+				libusb_error_name(r));
+			r = 2;
+			break;
+		}
+		r = 0;
+		if (stream_report_req) {
+			stream_report_req = 0;
+			hotplug_report(&hp, stderr);
+		}
+	}
+
+out2:
+	for (i=0; i<o->n_imgs; i++)
+		if (hp.types[i].registered)
+			libusb_hotplug_deregister_callback(hp.ctx,
+			                                   hp.types[i].cb);
+	/* devices being programmed are finished, queued ones dropped */
+	pthread_mutex_lock(&hp.lock);
+	hp.stop = 1;
+	pthread_cond_broadcast(&hp.cond);
+	pthread_mutex_unlock(&hp.lock);
+	for (i=0; i<n_threads; i++)
+		pthread_join(threads[i], NULL);
+	while ((j = hp.head)) {
+		hp.head = j->next;
+		libusb_unref_device(j->dev);
+		free(j);
+	}
+	hotplug_report(&hp, stderr);
+	pthread_cond_destroy(&hp.cond);
+	pthread_mutex_destroy(&hp.lock);
+	libusb_exit(hp.ctx);
+out:
+	if (hp.types)
+		for (i=0; i<o->n_imgs; i++)
+			record_free_all(hp.types[i].recs);
+	free(hp.types);
+	free(threads);
+	return r;
+}
@@ -0,0 +1,37 @@
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <signal.h>
+
+#include "usb.h"
+
+/* firmware image programmed onto each arriving device of type */
+struct hotplug_img {
+	const struct dev_type *type;
+	const char *path;
+	unsigned fmt;		/* see in_fmts */
+};
+
+struct hotplug_opts {
+	const struct hotplug_img *imgs;
+	unsigned n_imgs;
+	int sort, merge;
+	unsigned workers;	/* devices programmed concurrently */
+	unsigned depth;		/* control requests in flight per device */
+	unsigned timeout;	/* ms per request, 0: from the profile */
+	unsigned chunk;		/* bytes per request, 0: from the profile */
+	const struct dev_type *fx2;	/* type whose CPU is held in reset */
+};
+
+/* set asynchronously, e.g. by a signal handler, to have hotplug_run() return */
+extern volatile sig_atomic_t hotplug_quit;
+
+/* Parses each image once, then programs every device of the configured types
+ * as soon as it arrives (including those already attached), logging one line
+ * per device to stdout. Runs until hotplug_quit is set; statistics are printed
+ * to stderr then and whenever stream_report_req is set. Returns 0 unless
+ * setting up failed. */
+int hotplug_run(const struct hotplug_opts *o);
+
+#endif
@@ -0,0 +1,222 @@
+
+#define _POSIX_C_SOURCE	201501L	/* getopt(), optind */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <libusb.h>
+#include <stdio.h>
+#include <unistd.h>		/* getopt(), optind */
+
+#include "usb.h"
+#include "stream.h"
+
+#define DEFAULT_PACKETS		32
+#define DEFAULT_DEPTH		8
+
+/* what to do with the payload of packets that failed */
+enum pkt_err { PKT_SKIP, PKT_ZERO, PKT_ABORT };
+
+static const char *pkt_err_names[] = {
+	[PKT_SKIP ] = "skip",
+	[PKT_ZERO ] = "zero",
+	[PKT_ABORT] = "abort",
+};
+
+struct iso_sink {
+	FILE *out;
+	enum pkt_err on_err;
+	uint8_t *zero;
+
+	/* statistics */
+	uint64_t packets;
+	uint64_t dropped;	/* status != completed */
+	uint64_t shorts;	/* completed, but actual_length < length */
+	uint64_t empty;		/* completed without any payload */
+};
+
+static int iso_write(FILE *out, const uint8_t *buf, unsigned len)
+{
+	if (len && !fwrite(buf, len, 1, out)) {
+		fprintf(stderr, "error writing %u bytes: %s\n",
+			len, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int iso_drain(struct stream *s, const struct libusb_transfer *t)
+{
+	struct iso_sink *k = s->priv;
+	const struct libusb_iso_packet_descriptor *d;
+	const uint8_t *buf = t->buffer;
+	int i;
+
+	for (i=0; i<t->num_iso_packets; buf += d->length, i++) {
+		d = &t->iso_packet_desc[i];
+		k->packets++;
+		if (d->status != LIBUSB_TRANSFER_COMPLETED) {
+			k->dropped++;
+			switch (k->on_err) {
+			case PKT_SKIP:
+				continue;
+			case PKT_ZERO:
+				if (iso_write(k->out, k->zero, d->length))
+					return 1;
+				continue;
+			case PKT_ABORT:
+				fprintf(stderr, "packet %" PRIu64 " failed: "
+					"%s\n", k->packets - 1,
+					stream_status_name(d->status));
+				return 1;
+			}
+		}
+		if (!d->actual_length)
+			k->empty++;
+		else if (d->actual_length < d->length)
+			k->shorts++;
+		if (iso_write(k->out, buf, d->actual_length))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void iso_report(const struct iso_sink *k, FILE *f)
+{
+	double n = k->packets ? k->packets : 1;
+	fprintf(f, "%" PRIu64 " packets, %" PRIu64 " dropped (%.3f%%), "
+		"%" PRIu64 " short (%.3f%%), %" PRIu64 " empty (%.3f%%)\n",
+		k->packets, k->dropped, k->dropped / n * 100,
+		k->shorts, k->shorts / n * 100, k->empty, k->empty / n * 100);
+}
+
+static int run_usb(
+	libusb_context *ctx, libusb_device_handle *hdev, int n,
+	unsigned pkts, unsigned pkt_len, unsigned depth, struct iso_sink *k,
+	int argc, char **argv
+) {
+	int r;
+	if (argc < 1 || argc > 2)
+		return 1;
+
+	uint8_t ep = strtol(argv[0], NULL, 0);
+	unsigned timeout = argc > 1 ? strtol(argv[1], NULL, 0) : 500;
+
+	if (~ep & 0x80) {
+		fprintf(stderr, "only IN endpoints are supported\n");
+		return 1;
+	}
+	if (!pkt_len) {
+		r = libusb_get_max_iso_packet_size(libusb_get_device(hdev), ep);
+		if (r <= 0) {
+			fprintf(stderr, "error determining packet size of "
+				"ep 0x%02x: %s\n", ep, libusb_error_name(r));
+			return 3;
+		}
+		pkt_len = r;
+	}
+
+	struct stream s = STREAM_INIT(hdev, ep, 0, depth, timeout,
+	                              n > 0 ? n : -1);
+	s.n_iso = pkts;
+	s.iso_len = pkt_len;
+	s.iso = iso_drain;
+	s.priv = k;
+
+	k->zero = calloc(1, pkt_len);
+	if (!k->zero || stream_init(&s)) {
+		free(k->zero);
+		return 3;
+	}
+	fprintf(stderr, "streaming ep 0x%02x: %u transfers of %u packets "
+		"of %u bytes in flight\n", ep, depth, pkts, pkt_len);
+	r = stream_run(ctx, &s);
+	stream_report(&s, stderr);
+	iso_report(k, stderr);
+	stream_fini(&s);
+	free(k->zero);
+
+	if (fflush(k->out) && !r) {
+		fprintf(stderr, "error flushing output: %s\n", strerror(errno));
+		r = 7;
+	}
+	return r;
+}
+
+#define USAGE(ret,progname,uc)	FATAL(ret,"\
+usage: %s %s [-o <out>] [-P <pkts>] [-S <size>] [-Q <depth>] [-e <mode>]\n\
+          [-C <num>] <ep> [<timeout_ms>]\n\
+\n\
+%s\
+  -C <num>    number of transfers, 0 for infinite, stop on error (default: 0)\n\
+  -o <out>    write payload to file <out> instead of stdout\n\
+  -P <pkts>   isochronous packets per transfer (default: %d)\n\
+  -S <size>   bytes per packet (default: max. packet size of <ep>)\n\
+  -Q <depth>  keep <depth> transfers in flight (default: %d)\n\
+  -e <mode>   handling of failed packets: skip, zero (write zeros in their\n\
+              place) or abort (default: skip)\n\
+\n\
+Only IN endpoints are supported, <ep> & 0x80 must be set.\n\
+",progname,usb_common_usage(uc),usb_common_help(uc),DEFAULT_PACKETS,DEFAULT_DEPTH)
+
+int main(int argc, char **argv)
+{
+	struct usb_common uc = USB_COMMON_INIT(NULL,0,-1,-1);
+	struct iso_sink k = { .out = stdout, .on_err = PKT_SKIP, };
+	const char *out = NULL;
+	int r;
+	int opt;
+	int n = 0;
+	unsigned pkts = DEFAULT_PACKETS;
+	unsigned pkt_len = 0;
+	unsigned depth = DEFAULT_DEPTH;
+	unsigned i;
+
+	r = usb_common_parse_opts(&uc, argc, argv);
+	if (r)
+		return 1;
+
+	while ((opt = getopt(argc, argv, ":C:o:P:S:Q:e:h")) != -1)
+		switch (opt) {
+		case 'C': n = strtol(optarg, NULL, 0); break;
+		case 'o': out = optarg; break;
+		case 'P': pkts = strtoul(optarg, NULL, 0); break;
+		case 'S': pkt_len = strtoul(optarg, NULL, 0); break;
+		case 'Q': depth = strtoul(optarg, NULL, 0); break;
+		case 'e':
+			for (i=0; i<ARRAY_SIZE(pkt_err_names); i++)
+				if (!strcmp(optarg, pkt_err_names[i]))
+					break;
+			if (i == ARRAY_SIZE(pkt_err_names))
+				FATAL(1,"unknown packet error mode: '%s'\n",
+				      optarg);
+			k.on_err = i;
+			break;
+		case 'h': USAGE(0,argv[0],&uc);
+		case ':': FATAL(1,"argument expected for option '-%c'\n",optopt);
+		case '?': FATAL(1,"illegal option: '-%c'\n", optopt);
+		}
+
+	if (argc - optind < 1 || argc - optind > 2 || !pkts || !depth)
+		USAGE(1,argv[0],&uc);
+
+	if (out && !(k.out = fopen(out, "wb"))) {
+		perror(out);
+		return 1;
+	}
+
+	r = usb_common_setup(&uc);
+	if (r)
+		return 2;
+
+	r = run_usb(uc.ctx, uc.hdev, n, pkts, pkt_len, depth, &k,
+	            argc - optind, argv + optind);
+	if (r)
+		fprintf(stderr, "run_usb failed with code %d\n", r);
+
+	usb_common_teardown(&uc);
+	if (out)
+		fclose(k.out);
+	return r;
+}
@@ -0,0 +1,410 @@
+
+#define _POSIX_C_SOURCE		200809L	/* clock_gettime() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "load.h"
+#include "trace.h"
+
+#define LOAD_TUNE_ROUNDS	3 /* best of */
+
+int load_verbose = 1;
+
+/* the FX3 boot loader writes to SYSMEM and may take longer per request */
+const struct dev_type dev_types[N_DEV_TYPES] = {
+	[DEV_FX2] = { "fx2", { VID_CYPRESS, PID_FX2 }, 0x1000,  200 },
+	[DEV_FX3] = { "fx3", { VID_CYPRESS, PID_FX3 }, 0x1000, 1000 },
+};
+
+/* profiles */
+
+static const char * load_tune_path(char *buf, size_t len)
+{
+	const char *path = getenv(ENV_LOAD_TUNE), *home;
+
+	if (path)
+		return *path ? path : NULL;
+	if (!(home = getenv("HOME")))
+		return NULL;
+	snprintf(buf, len, "%s/" DEFAULT_LOAD_TUNE, home);
+	return buf;
+}
+
+static int load_dev_vid_pid(libusb_device *dev, addr_t vid_pid)
+{
+	struct libusb_device_descriptor desc;
+
+	if (!dev || libusb_get_device_descriptor(dev, &desc))
+		return 1;
+	vid_pid[0] = desc.idVendor;
+	vid_pid[1] = desc.idProduct;
+	return 0;
+}
+
+/* returns 0 if a profile was stored for vid_pid, the last one wins */
+static int load_tune_lookup(const addr_t vid_pid, struct load_profile *p)
+{
+	char buf[4096], line[128];
+	const char *path = load_tune_path(buf, sizeof(buf));
+	unsigned short vid, pid;
+	unsigned chunk, timeout;
+	FILE *f;
+	int r = 1;
+
+	if (!path || !(f = fopen(path, "r")))
+		return 1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "%4hx:%4hx %u %u", &vid, &pid, &chunk,
+		           &timeout) == 4 &&
+		    vid == vid_pid[0] && pid == vid_pid[1] &&
+		    chunk && chunk <= MAX_LOAD_CHUNK) {
+			p->chunk = chunk;
+			p->timeout = timeout;
+			r = 0;
+		}
+	fclose(f);
+	return r;
+}
+
+void load_profile_get(
+	struct load_profile *p, const struct dev_type *type, libusb_device *dev
+) {
+	struct load_profile tuned = { 0, 0 };
+	addr_t vid_pid;
+
+	if (!load_dev_vid_pid(dev, vid_pid))
+		load_tune_lookup(vid_pid, &tuned);
+	if (!p->chunk)
+		p->chunk = tuned.chunk ? tuned.chunk
+		         : type && type->chunk ? type->chunk
+		         : DEFAULT_LOAD_CHUNK;
+	if (!p->timeout)
+		p->timeout = tuned.timeout ? tuned.timeout
+		           : type && type->timeout ? type->timeout
+		           : DEFAULT_LOAD_TIMEOUT;
+}
+
+/* replaces the line for dev's VID:PID in the tune file */
+int load_tune_store(libusb_device *dev, const struct load_profile *p)
+{
+	char buf[4096], tmp[4100], line[128];
+	const char *path = load_tune_path(buf, sizeof(buf));
+	unsigned short vid, pid;
+	addr_t vid_pid;
+	FILE *in, *out;
+
+	if (load_dev_vid_pid(dev, vid_pid))
+		return 1;
+	if (!path) {
+		fprintf(stderr, "no place to store the tuned profile, set "
+			ENV_LOAD_TUNE "\n");
+		return 1;
+	}
+	snprintf(tmp, sizeof(tmp), "%s~", path);
+	if (!(out = fopen(tmp, "w"))) {
+		perror(tmp);
+		return 1;
+	}
+	if ((in = fopen(path, "r"))) {
+		while (fgets(line, sizeof(line), in))
+			if (sscanf(line, "%4hx:%4hx", &vid, &pid) != 2 ||
+			    vid != vid_pid[0] || pid != vid_pid[1])
+				fputs(line, out);
+		fclose(in);
+	}
+	fprintf(out, "%04hx:%04hx %u %u\n", vid_pid[0], vid_pid[1], p->chunk,
+		p->timeout);
+	if (fclose(out) || rename(tmp, path)) {
+		perror(path);
+		remove(tmp);
+		return 1;
+	}
+	fprintf(stderr, "stored chunk size %u, timeout %u ms for %04hx:%04hx "
+		"in %s\n", p->chunk, p->timeout, vid_pid[0], vid_pid[1], path);
+	return 0;
+}
+
+int usb_query_device_fw(libusb_device_handle *hdev, unsigned timeout)
+{
+	int res;
+	uint8_t v;
+	res = libusb_control_transfer(hdev,
+		0xc0, 0xa0, 0, 0, (uint8_t *)&v, sizeof(v),
+		timeout);
+	if (res < 0) {
+		fprintf(stderr, "error checking device boot-loader type: %s\n",
+			libusb_error_name(res));
+	} else if ((unsigned)res == sizeof(v)) {
+		return v;
+	} else {
+		fprintf(stderr,
+			"short read while checking device boot-loader type: "
+			"received: %u, requested: %zu\n", res, sizeof(v));
+	}
+	return -1;
+}
+
+/* stops the queue on short transfers */
+static int usb_control_chunk_done(struct ctrlq *q, struct ctrlq_req *r)
+{
+	if ((unsigned)r->result < r->wLength) {
+		fprintf(stderr,
+			"short %s %d < %u while transferring data\n",
+			r->bmRequestType & 0x80 ? "read" : "write", r->result,
+			r->wLength);
+		return 1;
+	}
+	return 0;
+}
+
+/* splits rec into requests of at most chunk bytes, a zero-length record into
+ * one zero-length request; returns the number written to reqs (NULL: just
+ * count them) */
+static size_t usb_control_chunks(
+	int ep, int req, unsigned chunk, struct record *rec,
+	struct ctrlq_req *reqs
+) {
+	uint8_t *data = rec->data;
+	uint32_t addr = rec->addr;
+	uint32_t size = rec->size;
+	size_t i, n = size ? (size + chunk - 1) / chunk : 1;
+
+	for (i=0; reqs && i<n; i++) {
+		uint16_t sz = size > chunk ? chunk : size;
+		if (load_verbose)
+			fprintf(stderr, "submitting %02x %02x val: %04x "
+				"idx: %04x len: %04x\n",
+				ep, req, addr & 0xffff, addr >> 16, sz);
+		reqs[i] = (struct ctrlq_req){
+			.bmRequestType = ep, .bRequest = req,
+			.wValue = addr & 0xffff, .wIndex = addr >> 16,
+			.wLength = sz, .data = data,
+		};
+		size -= sz;
+		addr += sz;
+		data += sz;
+	}
+	return n;
+}
+
+/* maps the result of ctrlq_run() on reqs to 0, 1 (error) or 2 (short) */
+static int usb_control_result(
+	const struct ctrlq *q, const struct ctrlq_req *reqs, int res
+) {
+	const struct ctrlq_req *r = &reqs[q->n_done];
+
+	if (res == 5 && r->result < 0) {
+		fprintf(stderr, "error %s control transfer data at 0x%04x%04x: "
+			"%s\n", r->bmRequestType & 0x80 ? "receiving"
+			                                : "sending",
+			r->wIndex, r->wValue, libusb_error_name(r->result));
+		return 1;
+	}
+	if (res == 5)
+		return 2;	/* short transfer */
+	return res ? 1 : 0;
+}
+
+/* transfers rec in chunks of at most chunk bytes, keeping up to q->depth of
+ * them in flight */
+int usb_control_tfer(
+	libusb_context *ctx, struct ctrlq *q, int ep, int req, unsigned chunk,
+	struct record *rec, uint32_t *tferd
+) {
+	size_t i, n = usb_control_chunks(ep, req, chunk, rec, NULL);
+	struct ctrlq_req *reqs = calloc(n, sizeof(*reqs));
+	int res = 0;
+
+	if (!reqs) {
+		fprintf(stderr, "error allocating %zu control requests\n", n);
+		return 1;
+	}
+	usb_control_chunks(ep, req, chunk, rec, reqs);
+
+	q->done = usb_control_chunk_done;
+	res = usb_control_result(q, reqs, ctrlq_run(ctx, q, reqs, n));
+	q->done = NULL;
+
+	if (tferd)
+		for (*tferd = 0, i=0; i<q->n_done; i++)
+			*tferd += reqs[i].wLength;
+	free(reqs);
+	return res;
+}
+
+/* Requests the boot loader must only see after all earlier ones completed and
+ * before any later one is sent: the zero-length FX3 entry point request and
+ * writes covering the FX2's CPUCS register. */
+static int usb_upload_barrier(const struct ctrlq_req *r)
+{
+	return !r->wLength ||
+	       (!r->wIndex && r->wValue <= FX2_REG_CPUCS &&
+	        FX2_REG_CPUCS < r->wValue + r->wLength);
+}
+
+/* queues the chunks of all records at once, keeping up to q->depth of them in
+ * flight across record boundaries; barrier requests are sent on their own */
+int usb_upload_records(
+	libusb_context *ctx,
+	struct ctrlq *q,
+	unsigned chunk,
+	struct record *head
+) {
+	struct ctrlq_req *reqs;
+	struct record *r;
+	size_t i, k, n = 0;
+	uint64_t t0 = trace_begin(), t1, bytes = 0;
+	int res = 0;
+
+	int fw = usb_query_device_fw(q->hdev, q->timeout);
+	if (load_verbose)
+		fprintf(stderr, "query: 0x%02x\n", fw);
+	trace_end("load", "query", t0, "\"fw\":%d", fw);
+
+	for (r = head; r; r = r->next) {
+		n += usb_control_chunks(0x40, USB_REQ_FIRMWARE_LOAD, chunk, r,
+		                        NULL);
+		bytes += r->size;
+	}
+	if (!(reqs = calloc(n ? n : 1, sizeof(*reqs)))) {
+		fprintf(stderr, "error allocating %zu control requests\n", n);
+		return 1;
+	}
+	for (r = head, i = 0; r; r = r->next)
+		i += usb_control_chunks(0x40, USB_REQ_FIRMWARE_LOAD, chunk, r,
+		                        reqs + i);
+
+	t1 = mono_ns();
+	q->done = usb_control_chunk_done;
+	for (i=0; i<n && !res; i=k) {
+		/* up to the next barrier, or the barrier alone */
+		k = i + 1;
+		if (!usb_upload_barrier(&reqs[i]))
+			while (k < n && !usb_upload_barrier(&reqs[k]))
+				k++;
+		t0 = trace_begin();
+		res = usb_control_result(q, reqs + i,
+		                         ctrlq_run(ctx, q, reqs + i, k - i));
+		trace_end("load", k - i == 1 && usb_upload_barrier(&reqs[i])
+		                  ? "barrier" : "pipeline", t0,
+		          "\"requests\":%zu,\"result\":%d", k - i, res);
+	}
+	q->done = NULL;
+	t1 = mono_ns() - t1;
+
+	if (res)
+		fprintf(stderr, "error uploading firmware\n");
+	else if (load_verbose)
+		fprintf(stderr, "uploaded %" PRIu64 " bytes in %zu requests, "
+			"%u in flight: %.3f ms, %.1f KB/s\n", bytes, n,
+			q->depth, t1 * 1e-6, t1 ? bytes * 1e6 / t1 : 0.0);
+	free(reqs);
+	return res;
+}
+
+/* uploads recs, holding the CPU of FX2 devices in reset meanwhile */
+int usb_load_firmware(
+	libusb_context *ctx, struct ctrlq *q, int fx2, unsigned chunk,
+	struct record *recs
+) {
+	uint64_t t0 = trace_begin();
+	int res;
+
+	if (fx2) {
+		if (load_verbose)
+			fprintf(stderr, "resetting CPU...\n");
+		libusb_control_transfer(q->hdev, 0x40, USB_REQ_FIRMWARE_LOAD,
+			FX2_REG_CPUCS, 0x0000, (uint8_t[]){0x01}, 1,
+			q->timeout);
+		trace_end("load", "cpu-reset", t0, NULL);
+	}
+
+	t0 = trace_begin();
+	res = usb_upload_records(ctx, q, chunk, recs);
+	trace_end("load", "upload", t0, "\"result\":%d", res);
+
+	if (fx2) {
+		if (load_verbose)
+			fprintf(stderr, "resuming CPU...\n");
+		t0 = trace_begin();
+		libusb_control_transfer(q->hdev, 0x40, USB_REQ_FIRMWARE_LOAD,
+			FX2_REG_CPUCS, 0x0000, (uint8_t[]){0x00}, 1,
+			q->timeout);
+		trace_end("load", "cpu-run", t0, NULL);
+	}
+
+	return res;
+}
+
+/* Measures upload and dump throughput on the scratch region [addr,addr+size)
+ * for chunk sizes from 64 bytes up to max_chunk in powers of two, verifying
+ * what is read back, and prints a table to f. Stops at the first chunk size
+ * that fails. Sets best->chunk to the fastest one and returns 0 if any
+ * worked. */
+int load_tune(
+	libusb_context *ctx, struct ctrlq *q, uint32_t addr, uint32_t size,
+	unsigned max_chunk, struct load_profile *best, FILE *f
+) {
+	struct record *wr = record_create(addr, size);
+	struct record *rd = record_create(addr, size);
+	uint64_t t, t_up, t_down, t_best = UINT64_MAX;
+	unsigned chunk, round;
+	uint32_t i, tferd;
+	int verbose = load_verbose, res = 0, r = 1;
+
+	if (!wr || !rd) {
+		free(wr);
+		free(rd);
+		return 1;
+	}
+	for (i=0; i<size; i++)
+		wr->data[i] = i ^ i >> 8 ^ 0x5a;
+
+	load_verbose = 0;
+	fprintf(f, "%8s %14s %14s  %s\n", "chunk", "upload[KB/s]",
+		"dump[KB/s]", "result");
+	for (chunk = 64; !res && chunk <= max_chunk && chunk <= size;
+	     chunk *= 2) {
+		t_up = t_down = UINT64_MAX;
+		for (round=0; !res && round<LOAD_TUNE_ROUNDS; round++) {
+			t = mono_ns();
+			res = usb_control_tfer(ctx, q, 0x40,
+			                       USB_REQ_FIRMWARE_LOAD, chunk, wr,
+			                       NULL);
+			if (res)
+				break;
+			if ((t = mono_ns() - t) < t_up)
+				t_up = t;
+			memset(rd->data, 0, size);
+			t = mono_ns();
+			res = usb_control_tfer(ctx, q, 0xc0,
+			                       USB_REQ_FIRMWARE_LOAD, chunk, rd,
+			                       &tferd);
+			if (res)
+				break;
+			if ((t = mono_ns() - t) < t_down)
+				t_down = t;
+			if (memcmp(wr->data, rd->data, size))
+				res = 3;
+		}
+		if (res) {
+			fprintf(f, "%8u %14s %14s  %s\n", chunk, "-", "-",
+				res == 3 ? "mismatch" : "failed");
+			break;
+		}
+		fprintf(f, "%8u %14.1f %14.1f  ok\n", chunk,
+			size * 1e6 / t_up, size * 1e6 / t_down);
+		if (t_up + t_down < t_best) {
+			t_best = t_up + t_down;
+			best->chunk = chunk;
+			r = 0;
+		}
+	}
+	load_verbose = verbose;
+	free(wr);
+	free(rd);
+	return r;
+}
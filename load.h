@@ -0,0 +1,66 @@
+
+#ifndef LOAD_H
+#define LOAD_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <libusb.h>
+
+#include "usb.h"
+#include "fw.h"
+#include "ctrlq.h"
+
+#define USB_REQ_FIRMWARE_LOAD	0xa0
+#define FX2_REG_CPUCS		0xe600
+
+#define VID_CYPRESS		0x04b4
+#define PID_FX2			0x8613 /* default boot image identification */
+#define PID_FX3			0x00f3 /* default boot image identification */
+
+#define DEFAULT_LOAD_CHUNK	0x1000 /* bytes per request */
+#define DEFAULT_LOAD_TIMEOUT	200 /* ms per request */
+#define MAX_LOAD_CHUNK		0xffff /* wLength */
+
+/* tuned profiles, one "<vid>:<pid> <chunk> <timeout_ms>" per line */
+#define ENV_LOAD_TUNE		"FXPROG_TUNE"
+#define DEFAULT_LOAD_TUNE	".fxprog-tune" /* in $HOME */
+
+enum dev_type_t { DEV_FX2, DEV_FX3, N_DEV_TYPES };
+
+extern const struct dev_type dev_types[N_DEV_TYPES];
+
+/* print each request and the boot-loader type to stderr, default: 1 */
+extern int load_verbose;
+
+/* request size and timeout used for loading and dumping RAM */
+struct load_profile {
+	unsigned chunk;		/* bytes */
+	unsigned timeout;	/* ms */
+};
+
+/* Fills in the fields of p left 0 (not overridden): from the profile tuned for
+ * dev's VID:PID, else from type (may be NULL), else the defaults. */
+void load_profile_get(
+	struct load_profile *p, const struct dev_type *type, libusb_device *dev
+);
+int load_tune_store(libusb_device *dev, const struct load_profile *p);
+int load_tune(
+	libusb_context *ctx, struct ctrlq *q, uint32_t addr, uint32_t size,
+	unsigned max_chunk, struct load_profile *best, FILE *f
+);
+
+int usb_query_device_fw(libusb_device_handle *hdev, unsigned timeout);
+int usb_control_tfer(
+	libusb_context *ctx, struct ctrlq *q, int ep, int req, unsigned chunk,
+	struct record *rec, uint32_t *tferd
+);
+int usb_upload_records(
+	libusb_context *ctx, struct ctrlq *q, unsigned chunk,
+	struct record *head
+);
+int usb_load_firmware(
+	libusb_context *ctx, struct ctrlq *q, int fx2, unsigned chunk,
+	struct record *recs
+);
+
+#endif
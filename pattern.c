@@ -0,0 +1,264 @@
+
+#define _POSIX_C_SOURCE		200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "pattern.h"
+
+/* PRBS words with more bit errors than this count towards losing sync, other
+ * patterns lose sync on consecutive mismatches of any size */
+#define CHK_BAD_BITS		8
+/* consecutive bad words triggering a resynchronization */
+#define CHK_BAD_RUN		4
+/* words compared per block on the fast path */
+#define CHK_BLOCK		64
+
+const char *pattern_help = "\
+counter, prbs7, prbs15, prbs31, word:<value>";
+
+static const struct {
+	const char *name;
+	unsigned n, m;		/* x^n + x^m + 1 */
+} prbs[] = {
+	[PAT_PRBS7 ] = { "prbs7" ,  7,  6, },
+	[PAT_PRBS15] = { "prbs15", 15, 14, },
+	[PAT_PRBS31] = { "prbs31", 31, 28, },
+};
+
+/* 64 bits of the stream h[0],h[1] starting lag bits before its end, lag in
+ * (64,128] */
+static inline uint64_t bits_back(const uint64_t h[2], unsigned lag)
+{
+	unsigned s = 128 - lag;
+	return s ? h[0] >> s | h[1] << (64 - s) : h[0];
+}
+
+static inline uint64_t prbs_step(const uint64_t h[2], const unsigned lag[2])
+{
+	return bits_back(h, lag[0]) ^ bits_back(h, lag[1]);
+}
+
+/* the stream is delayed by the two words of history kept in h */
+static inline uint64_t prbs_next(struct pattern *p)
+{
+	uint64_t w = p->h[0], n = prbs_step(p->h, p->lag);
+	p->h[0] = p->h[1];
+	p->h[1] = n;
+	return w;
+}
+
+static inline uint64_t pattern_next(struct pattern *p)
+{
+	uint64_t w;
+	switch (p->type) {
+	case PAT_COUNTER:
+		w = p->word | (uint64_t)(uint32_t)(p->word + 1) << 32;
+		p->word += 2;
+		return w;
+	case PAT_WORD:
+		return p->word | (uint64_t)p->word << 32;
+	default:
+		return prbs_next(p);
+	}
+}
+
+/* seeds the PRBS from the all-ones state, bit by bit */
+static void prbs_init(struct pattern *p)
+{
+	unsigned n = prbs[p->type].n, m = prbs[p->type].m, k, j;
+	uint32_t lfsr = (1U << n) - 1;
+	uint64_t bit;
+
+	/* s[k] = s[k-m] ^ s[k-n] implies s[k] = s[k-m*2^j] ^ s[k-n*2^j] since
+	 * squaring over GF(2) keeps the polynomial's roots; pick j such that a
+	 * whole 64-bit word only depends on previous words */
+	for (j = 0; (m << j) < 64; j++);
+	p->lag[0] = m << j;
+	p->lag[1] = n << j;
+
+	p->h[0] = p->h[1] = 0;
+	for (k=0; k<128; k++) {
+		bit = (lfsr >> (n - 1) ^ lfsr >> (m - 1)) & 1;
+		lfsr = (lfsr << 1 | bit) & ((1U << n) - 1);
+		p->h[k / 64] |= bit << (k % 64);
+	}
+}
+
+int pattern_parse(struct pattern *p, const char *spec)
+{
+	unsigned i;
+	char *end;
+
+	memset(p, 0, sizeof(*p));
+	p->off = 8;
+	if (!strcmp(spec, "counter")) {
+		p->type = PAT_COUNTER;
+		return 0;
+	}
+	if (!strncmp(spec, "word:", 5)) {
+		p->type = PAT_WORD;
+		p->word = strtoul(spec + 5, &end, 0);
+		if (spec[5] && !*end)
+			return 0;
+	}
+	for (i=0; i<ARRAY_SIZE(prbs); i++)
+		if (prbs[i].name && !strcmp(spec, prbs[i].name)) {
+			p->type = i;
+			prbs_init(p);
+			return 0;
+		}
+	fprintf(stderr, "invalid pattern '%s', supported: %s\n",
+		spec, pattern_help);
+	return 1;
+}
+
+void pattern_fill(struct pattern *p, uint8_t *buf, size_t len)
+{
+	size_t n;
+	uint64_t w;
+
+	/* remainder of the current word */
+	if (p->off < 8) {
+		n = 8 - p->off < len ? 8 - p->off : len;
+		memcpy(buf, (uint8_t *)&p->cur + p->off, n);
+		p->off += n;
+		buf += n;
+		len -= n;
+	}
+	for (; len >= 8; buf += 8, len -= 8) {
+		w = pattern_next(p);
+		memcpy(buf, &w, 8);
+	}
+	if (len) {
+		p->cur = pattern_next(p);
+		memcpy(buf, &p->cur, len);
+		p->off = len;
+	}
+}
+
+void checker_init(struct checker *c, const struct pattern *p)
+{
+	memset(c, 0, sizeof(*c));
+	c->p = *p;
+	c->first_error = UINT64_MAX;
+}
+
+/* re-derives the expected stream from the received words prev, w */
+static void checker_resync(struct checker *c, uint64_t w)
+{
+	switch (c->p.type) {
+	case PAT_COUNTER:
+		c->p.word = (uint32_t)(w >> 32) + 1;
+		break;
+	case PAT_WORD:
+		break;
+	default:
+		c->p.h[0] = prbs_step((uint64_t[]){ c->prev, w }, c->p.lag);
+		c->p.h[1] = prbs_step((uint64_t[]){ w, c->p.h[0] }, c->p.lag);
+		break;
+	}
+	/* the mismatches leading here were due to the slip, not bit errors */
+	c->bit_errors -= c->run_errors;
+	c->bad_run = 0;
+	c->run_errors = 0;
+	c->resyncs++;
+}
+
+/* compares one received word at byte offset c->bytes */
+static void checker_word(struct checker *c, uint64_t w)
+{
+	uint64_t x = w ^ pattern_next(&c->p);
+	unsigned e = __builtin_popcountll(x);
+
+	if (e) {
+		if (c->first_error == UINT64_MAX)
+			c->first_error = c->bytes + __builtin_ctzll(x) / 8;
+		c->bit_errors += e;
+	}
+	if (c->p.type != PAT_WORD &&
+	    e > (c->p.type == PAT_COUNTER ? 0 : CHK_BAD_BITS)) {
+		c->run_errors += e;
+		if (++c->bad_run >= CHK_BAD_RUN)
+			checker_resync(c, w);
+	} else {
+		c->bad_run = 0;
+		c->run_errors = 0;
+	}
+	c->prev = w;
+	c->bytes += 8;
+}
+
+/* fast path: compares n <= CHK_BLOCK aligned words, returns 0 if all matched,
+ * otherwise the pattern state is left untouched */
+static int checker_block(struct checker *c, const uint8_t *buf, size_t n)
+{
+	uint64_t exp[CHK_BLOCK], w, diff = 0;
+	struct pattern p = c->p;
+	size_t i;
+
+	for (i=0; i<n; i++)
+		exp[i] = pattern_next(&p);
+	for (i=0; i<n; i++) {
+		memcpy(&w, buf + 8 * i, 8);
+		diff |= w ^ exp[i];
+	}
+	if (diff)
+		return 1;
+	c->p = p;
+	memcpy(&c->prev, buf + 8 * (n - 1), 8);
+	c->bytes += 8 * n;
+	c->bad_run = 0;
+	c->run_errors = 0;
+	return 0;
+}
+
+void checker_feed(struct checker *c, const uint8_t *buf, size_t len)
+{
+	size_t n, i;
+	uint64_t w;
+
+	/* complete a partial word */
+	if (c->n_acc) {
+		n = 8 - c->n_acc < len ? 8 - c->n_acc : len;
+		memcpy((uint8_t *)&c->acc + c->n_acc, buf, n);
+		c->n_acc += n;
+		buf += n;
+		len -= n;
+		if (c->n_acc < 8)
+			return;
+		checker_word(c, c->acc);
+		c->n_acc = 0;
+	}
+
+	while (len >= 8) {
+		n = len / 8 < CHK_BLOCK ? len / 8 : CHK_BLOCK;
+		if (checker_block(c, buf, n))
+			for (i=0; i<n; i++) {
+				memcpy(&w, buf + 8 * i, 8);
+				checker_word(c, w);
+			}
+		buf += 8 * n;
+		len -= 8 * n;
+	}
+
+	if (len) {
+		c->acc = 0;
+		memcpy(&c->acc, buf, len);
+		c->n_acc = len;
+	}
+}
+
+void checker_report(const struct checker *c, const char *name, FILE *f)
+{
+	fprintf(f, "%s: %" PRIu64 " bytes checked, %" PRIu64 " bit errors "
+		"(BER %.3g), %" PRIu64 " resyncs", name, c->bytes,
+		c->bit_errors,
+		c->bytes ? (double)c->bit_errors / (c->bytes * 8) : 0.0,
+		c->resyncs);
+	if (c->first_error != UINT64_MAX)
+		fprintf(f, ", first error at byte %" PRIu64, c->first_error);
+	fprintf(f, "\n");
+}
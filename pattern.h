@@ -0,0 +1,55 @@
+
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+enum pattern_type {
+	PAT_COUNTER,	/* 32-bit little-endian counter words */
+	PAT_PRBS7,	/* x^7  + x^6  + 1 */
+	PAT_PRBS15,	/* x^15 + x^14 + 1 */
+	PAT_PRBS31,	/* x^31 + x^28 + 1 */
+	PAT_WORD,	/* fixed 32-bit word, repeated */
+};
+
+/* Byte stream generator, producing 64 bits per step. PRBS bits are ordered
+ * LSB first within each little-endian 64-bit word. */
+struct pattern {
+	enum pattern_type type;
+	uint32_t word;		/* PAT_COUNTER: next value, PAT_WORD: value */
+	unsigned lag[2];	/* PRBS: bit lags of the squared polynomial */
+	uint64_t h[2];		/* PRBS: last two words, h[1] most recent */
+	uint64_t cur;		/* current word ... */
+	unsigned off;		/* ... of which off bytes have been consumed */
+};
+
+/* Compares a byte stream against a pattern, counting bit errors. After a run
+ * of grossly mismatching words the expected stream is re-derived from the
+ * received data (resynchronization), e.g. after lost packets. */
+struct checker {
+	struct pattern p;
+	uint64_t acc;		/* partial word received so far ... */
+	unsigned n_acc;		/* ... consisting of n_acc bytes */
+	uint64_t prev;		/* last received full word */
+	unsigned bad_run;	/* consecutive grossly mismatching words */
+	uint64_t run_errors;	/* bit errors within bad_run */
+
+	/* statistics */
+	uint64_t bytes;
+	uint64_t bit_errors;
+	uint64_t first_error;	/* byte offset, UINT64_MAX: none */
+	uint64_t resyncs;
+};
+
+int pattern_parse(struct pattern *p, const char *spec);
+void pattern_fill(struct pattern *p, uint8_t *buf, size_t len);
+
+void checker_init(struct checker *c, const struct pattern *p);
+void checker_feed(struct checker *c, const uint8_t *buf, size_t len);
+void checker_report(const struct checker *c, const char *name, FILE *f);
+
+extern const char *pattern_help;
+
+#endif
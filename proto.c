@@ -0,0 +1,162 @@
+
+#define _POSIX_C_SOURCE		200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "proto.h"
+
+int proto_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* returns 1 on EOF before the first byte; signals installed w/o SA_RESTART
+ * interrupt it (-1), e.g. so that fxd quits while a client keeps its
+ * connection open */
+int proto_read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	size_t got = 0;
+	ssize_t r;
+
+	while (got < len) {
+		r = read(fd, p + got, len - got);
+		if (!r && !got)
+			return 1;
+		if (r <= 0)
+			return -1;
+		got += r;
+	}
+	return 0;
+}
+
+static int proto_reserve(struct proto_buf *b, size_t len)
+{
+	size_t cap = b->cap ? b->cap : 256;
+	uint8_t *data;
+
+	if (b->len + len + 1 <= b->cap)
+		return 0;
+	while (cap < b->len + len + 1)
+		cap *= 2;
+	if (!(data = realloc(b->data, cap)))
+		return -1;
+	b->data = data;
+	b->cap = cap;
+	return 0;
+}
+
+int proto_put(struct proto_buf *b, const void *data, size_t len)
+{
+	if (proto_reserve(b, len))
+		return -1;
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	b->data[b->len] = '\0';
+	return 0;
+}
+
+int proto_printf(struct proto_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0 || proto_reserve(b, n))
+		return -1;
+	va_start(ap, fmt);
+	vsnprintf((char *)b->data + b->len, n + 1, fmt, ap);
+	va_end(ap);
+	b->len += n;
+	return 0;
+}
+
+int proto_send_buf(int fd, const void *data, size_t len)
+{
+	uint32_t n = len;
+
+	if (proto_write_all(fd, &n, sizeof(n)))
+		return -1;
+	return proto_write_all(fd, data, len);
+}
+
+int proto_recv_buf(int fd, struct proto_buf *b)
+{
+	uint32_t n;
+
+	b->len = 0;
+	if (proto_read_all(fd, &n, sizeof(n)) || n > PROTO_MAX_LEN ||
+	    proto_reserve(b, n) || proto_read_all(fd, b->data, n))
+		return -1;
+	b->len = n;
+	b->data[n] = '\0';
+	return 0;
+}
+
+int proto_send_req(int fd, int argc, char **argv, const void *payload,
+                   size_t len)
+{
+	uint32_t n = argc;
+	int i;
+
+	if (proto_write_all(fd, &n, sizeof(n)))
+		return -1;
+	for (i=0; i<argc; i++)
+		if (proto_send_buf(fd, argv[i], strlen(argv[i])))
+			return -1;
+	return proto_send_buf(fd, payload, len);
+}
+
+int proto_recv_req(int fd, int *argc, char **argv, struct proto_buf *args,
+                   struct proto_buf *payload)
+{
+	size_t off[PROTO_MAX_ARGS];
+	uint32_t n, len, i;
+	int r;
+
+	if ((r = proto_read_all(fd, &n, sizeof(n))))
+		return r;
+	if (n > PROTO_MAX_ARGS)
+		return -1;
+	args->len = 0;
+	for (i=0; i<n; i++) {
+		off[i] = args->len;
+		if (proto_read_all(fd, &len, sizeof(len)) ||
+		    len > PROTO_MAX_LEN || proto_reserve(args, len + 1) ||
+		    proto_read_all(fd, args->data + args->len, len))
+			return -1;
+		args->len += len;
+		args->data[args->len++] = '\0';
+	}
+	/* args may have moved while growing */
+	for (i=0; i<n; i++)
+		argv[i] = (char *)args->data + off[i];
+	argv[n] = NULL;
+	*argc = n;
+	return proto_recv_buf(fd, payload);
+}
+
+const char * proto_socket_path(const char *opt)
+{
+	const char *path = opt ? opt : getenv(ENV_FXD_SOCKET);
+	return path ? path : DEFAULT_FXD_SOCKET;
+}
@@ -0,0 +1,50 @@
+
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* Protocol between fxd and fxc over a Unix domain stream socket, all
+ * integers in host byte order:
+ *
+ * request:  u32 argc, argc times { u32 len, len bytes }, u32 len, payload
+ * response: i32 status, u32 len, output, u32 len, error message
+ *
+ * argv[0] names the operation, see fxd.c. Several requests may be sent over
+ * one connection. */
+
+#define ENV_FXD_SOCKET		"FXD_SOCKET"
+#define DEFAULT_FXD_SOCKET	"/tmp/fxd.sock"
+
+#define PROTO_MAX_ARGS		64
+#define PROTO_MAX_LEN		(64U << 20)
+
+/* a length-prefixed byte string */
+struct proto_buf {
+	uint8_t *data;
+	size_t len, cap;
+};
+
+int proto_write_all(int fd, const void *buf, size_t len);
+int proto_read_all(int fd, void *buf, size_t len);
+
+int proto_put(struct proto_buf *b, const void *data, size_t len);
+int proto_printf(struct proto_buf *b, const char *fmt, ...)
+	__attribute__((format(printf,2,3)));
+
+int proto_send_buf(int fd, const void *data, size_t len);
+/* receives a length-prefixed string into b, NUL-terminated for convenience */
+int proto_recv_buf(int fd, struct proto_buf *b);
+
+int proto_send_req(int fd, int argc, char **argv, const void *payload,
+                   size_t len);
+/* returns 0 on success, 1 on EOF before the request and -1 on errors; argv
+ * must hold PROTO_MAX_ARGS + 1 pointers, the strings point into args and stay
+ * valid until it is reused */
+int proto_recv_req(int fd, int *argc, char **argv, struct proto_buf *args,
+                   struct proto_buf *payload);
+
+const char * proto_socket_path(const char *opt);
+
+#endif
@@ -0,0 +1,166 @@
+
+#define _POSIX_C_SOURCE		200809L	/* clock_gettime() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "common.h"
+#include "ring.h"
+
+/* mem, if not NULL, provides nslots * slot_size bytes owned by the caller */
+int ring_init(struct ring *r, unsigned nslots, unsigned slot_size, FILE *out,
+              uint8_t *mem)
+{
+	memset(r, 0, sizeof(*r));
+	r->own_mem = !mem;
+	r->mem    = mem ? mem : malloc((size_t)nslots * slot_size);
+	r->lens   = calloc(nslots, sizeof(*r->lens));
+	r->filled = calloc(nslots, sizeof(*r->filled));
+	if (!r->mem || !r->lens || !r->filled) {
+		fprintf(stderr, "error allocating ring of %u slots of %u "
+			"bytes\n", nslots, slot_size);
+		ring_fini(r);
+		return 1;
+	}
+	r->nslots = nslots;
+	r->slot_size = slot_size;
+	r->out = out;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->done, 0);
+	sem_init(&r->avail, 0, 0);
+	return 0;
+}
+
+void ring_fini(struct ring *r)
+{
+	if (r->nslots)
+		sem_destroy(&r->avail);
+	if (r->own_mem)
+		free(r->mem);
+	free(r->lens);
+	free(r->filled);
+	r->mem = NULL;
+	r->lens = NULL;
+	r->filled = NULL;
+	r->nslots = 0;
+}
+
+/* returns the next free slot or NULL if the writer has not yet caught up */
+uint8_t * ring_reserve(struct ring *r)
+{
+	unsigned long tail = atomic_load_explicit(&r->tail,
+	                                          memory_order_acquire);
+	uint8_t *slot;
+
+	if (r->reserved - tail >= r->nslots)
+		return NULL;
+	if (r->t_stall.tv_sec || r->t_stall.tv_nsec) {
+		r->stall_ns += mono_ns() - ts_ns(&r->t_stall);
+		memset(&r->t_stall, 0, sizeof(r->t_stall));
+	}
+	slot = r->mem + (size_t)(r->reserved % r->nslots) * r->slot_size;
+	r->reserved++;
+	return slot;
+}
+
+/* records that the producer had to hold back a transfer for lack of slots;
+ * counts once per episode of a full ring */
+void ring_stall(struct ring *r)
+{
+	if (r->t_stall.tv_sec || r->t_stall.tv_nsec)
+		return;
+	r->stalls++;
+	clock_gettime(CLOCK_MONOTONIC, &r->t_stall);
+}
+
+/* slots may complete out of order, they are published strictly in order */
+void ring_commit(struct ring *r, const uint8_t *slot, unsigned len)
+{
+	unsigned i = (slot - r->mem) / r->slot_size;
+	unsigned long head = atomic_load_explicit(&r->head,
+	                                          memory_order_relaxed);
+	unsigned long tail, n = 0;
+
+	r->lens[i] = len;
+	r->filled[i] = 1;
+	while (head + n < r->reserved && r->filled[(head + n) % r->nslots]) {
+		r->filled[(head + n) % r->nslots] = 0;
+		n++;
+	}
+	if (!n)
+		return;
+	head += n;
+	atomic_store_explicit(&r->head, head, memory_order_release);
+	while (n--)
+		sem_post(&r->avail);
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (head - tail > r->hwm)
+		r->hwm = head - tail;
+}
+
+static void * ring_writer(void *arg)
+{
+	struct ring *r = arg;
+	unsigned long tail = 0, head;
+	uint64_t t0, dt;
+
+	while (1) {
+		while (sem_wait(&r->avail) && errno == EINTR);
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		if (tail == head) {
+			if (atomic_load(&r->done))
+				break;
+			continue;
+		}
+		unsigned i = tail % r->nslots;
+		if (!r->err && r->lens[i]) {
+			t0 = mono_ns();
+			if (!fwrite(r->mem + (size_t)i * r->slot_size,
+			            r->lens[i], 1, r->out)) {
+				fprintf(stderr, "error writing %u bytes: %s\n",
+					r->lens[i], strerror(errno));
+				r->err = 1;
+			}
+			dt = mono_ns() - t0;
+			if (dt > r->max_write_ns)
+				r->max_write_ns = dt;
+		}
+		atomic_store_explicit(&r->tail, ++tail, memory_order_release);
+	}
+	if (!r->err && fflush(r->out)) {
+		fprintf(stderr, "error flushing output: %s\n", strerror(errno));
+		r->err = 1;
+	}
+	return NULL;
+}
+
+int ring_start(struct ring *r)
+{
+	int e = pthread_create(&r->writer, NULL, ring_writer, r);
+	if (e)
+		fprintf(stderr, "error starting writer thread: %s\n",
+			strerror(e));
+	return e ? 1 : 0;
+}
+
+/* waits for the writer to drain all committed slots */
+int ring_finish(struct ring *r)
+{
+	atomic_store(&r->done, 1);
+	sem_post(&r->avail);
+	pthread_join(r->writer, NULL);
+	return r->err;
+}
+
+void ring_report(const struct ring *r, FILE *f)
+{
+	fprintf(f, "ring: %u slots of %u bytes, high-water mark %lu slots, "
+		"%lu producer stalls (%.3f ms), slowest write %.3f ms\n",
+		r->nslots, r->slot_size, r->hwm, r->stalls, r->stall_ns * 1e-6,
+		r->max_write_ns * 1e-6);
+}
@@ -0,0 +1,55 @@
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/* Single-producer single-consumer ring of fixed-size slots. The producer (the
+ * USB event loop) reserves slots as transfer buffers and commits them once
+ * filled, the consumer (a writer thread) drains committed slots to a FILE.
+ * Slot indices are free-running counters, slot i lives at (i % nslots). */
+struct ring {
+	uint8_t *mem;
+	int own_mem;
+	unsigned *lens;
+	uint8_t *filled;		/* producer only: committed out of order */
+	unsigned nslots, slot_size;
+
+	unsigned long reserved;		/* producer only */
+	atomic_ulong head;		/* committed by producer */
+	atomic_ulong tail;		/* released by consumer */
+	atomic_int done;
+	sem_t avail;			/* posted per committed slot */
+
+	FILE *out;
+	pthread_t writer;
+	int err;
+
+	/* statistics */
+	unsigned long hwm;		/* max. committed, not yet written */
+	unsigned long stalls;		/* producer found the ring full */
+	uint64_t stall_ns;		/* time spent with full ring */
+	uint64_t max_write_ns;		/* slowest write of one slot */
+	struct timespec t_stall;
+};
+
+int ring_init(struct ring *r, unsigned nslots, unsigned slot_size, FILE *out,
+              uint8_t *mem);
+void ring_fini(struct ring *r);
+
+/* producer side */
+uint8_t * ring_reserve(struct ring *r);
+void ring_commit(struct ring *r, const uint8_t *slot, unsigned len);
+void ring_stall(struct ring *r);
+
+/* consumer side */
+int ring_start(struct ring *r);
+int ring_finish(struct ring *r);
+
+void ring_report(const struct ring *r, FILE *f);
+
+#endif
@@ -0,0 +1,399 @@
+
+#define _POSIX_C_SOURCE		200809L	/* clock_gettime() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "common.h"
+#include "stream.h"
+#include "trace.h"
+
+volatile sig_atomic_t stream_report_req;
+
+const char * stream_status_name(enum libusb_transfer_status status)
+{
+	static const char *names[] = {
+		[LIBUSB_TRANSFER_COMPLETED] = "completed",
+		[LIBUSB_TRANSFER_ERROR    ] = "error",
+		[LIBUSB_TRANSFER_TIMED_OUT] = "timed out",
+		[LIBUSB_TRANSFER_CANCELLED] = "cancelled",
+		[LIBUSB_TRANSFER_STALL    ] = "stall",
+		[LIBUSB_TRANSFER_NO_DEVICE] = "no device",
+		[LIBUSB_TRANSFER_OVERFLOW ] = "overflow",
+	};
+	if ((unsigned)status < ARRAY_SIZE(names) && names[status])
+		return names[status];
+	return "unknown";
+}
+
+/* Allocates a transfer buffer. With zerocopy, usbfs is asked to map DMA-able
+ * memory into our address space so the kernel does not need to copy between
+ * its own buffers and ours; if that is unsupported, fall back to the heap.
+ * *dev_mem tells which path was taken. */
+uint8_t * stream_buf_alloc(libusb_device_handle *hdev, size_t len,
+                           int zerocopy, int *dev_mem)
+{
+	uint8_t *buf = NULL;
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	if (zerocopy)
+		buf = libusb_dev_mem_alloc(hdev, len);
+#endif
+	*dev_mem = buf != NULL;
+	if (!buf)
+		buf = calloc(1, len);
+	return buf;
+}
+
+void stream_buf_free(libusb_device_handle *hdev, uint8_t *buf, size_t len,
+                     int dev_mem)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	if (dev_mem) {
+		libusb_dev_mem_free(hdev, buf, len);
+		return;
+	}
+#endif
+	free(buf);
+}
+
+static const char * stream_type_name(const struct stream *s)
+{
+	return s->n_iso ? "isochronous" : "bulk";
+}
+
+static void stream_fail(struct stream *s, int err)
+{
+	if (!s->err)
+		s->err = err;
+	stream_cancel(s);
+}
+
+/* (re-)submits t unless the stream is stopping or enough transfers have been
+ * submitted already */
+static void stream_submit(struct stream *s, struct libusb_transfer *t)
+{
+	struct stream_tfer *c = t->user_data;
+	int r;
+
+	if (s->stop || (s->n >= 0 && s->submitted >= s->n))
+		return;
+	if (s->t_stop && mono_ns() >= s->t_stop) {
+		s->stop = 1;
+		return;
+	}
+
+	if (~s->ep & 0x80) {
+		/* host to device transfer */
+		r = s->fill(s, t->buffer, s->len);
+		if (r <= 0) {
+			s->stop = 1;
+			if (r < 0)
+				stream_fail(s, 2);
+			return;
+		}
+		t->length = r;
+	} else {
+		t->length = s->len;
+		if (s->ring && !(t->buffer = ring_reserve(s->ring))) {
+			ring_stall(s->ring);
+			s->parked[s->n_parked++] = t;
+			return;
+		}
+	}
+
+	if (s->lat || s->ts_log || trace_file)
+		c->t_submit = mono_ns();
+	r = libusb_submit_transfer(t);
+	if (r) {
+		fprintf(stderr, "error submitting %s transfer: %s\n",
+			stream_type_name(s), libusb_error_name(r));
+		if (s->ring)
+			/* release the slot, later ones could not be written */
+			ring_commit(s->ring, t->buffer, 0);
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			s->gone = 1;
+		stream_fail(s, 5);
+		return;
+	}
+	s->in_flight++;
+	s->submitted++;
+}
+
+static void LIBUSB_CALL stream_cb(struct libusb_transfer *t)
+{
+	struct stream_tfer *c = t->user_data;
+	struct stream *s = c->s;
+
+	s->in_flight--;
+	if (s->ring)
+		ring_commit(s->ring, t->buffer,
+		            t->status == LIBUSB_TRANSFER_COMPLETED
+		            ? t->actual_length : 0);
+	if (t->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+	s->t_end = mono_ns();
+	if (s->ts_log)
+		stream_log(s->ts_log, s->ep, c->t_submit, s->t_end,
+		           stream_status_name(t->status), t->actual_length);
+	if (trace_file)
+		trace_span("usb", stream_type_name(s), c->t_submit, s->t_end,
+		           "\"ep\":%u,\"len\":%d,\"status\":\"%s\"", s->ep,
+		           t->actual_length, stream_status_name(t->status));
+	if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+		s->errors++;
+		if (t->status == LIBUSB_TRANSFER_TIMED_OUT)
+			s->timeouts++;
+		if (s->keep_going && (t->status == LIBUSB_TRANSFER_TIMED_OUT ||
+		                      t->status == LIBUSB_TRANSFER_ERROR)) {
+			stream_submit(s, t);
+			return;
+		}
+		fprintf(stderr, "error during %s transfer: %s\n",
+			stream_type_name(s), stream_status_name(t->status));
+		if (t->status == LIBUSB_TRANSFER_NO_DEVICE)
+			s->gone = 1;
+		stream_fail(s, 5);
+		return;
+	}
+
+	s->completed++;
+	if (s->n_iso) {
+		int i;
+		for (i=0; i<t->num_iso_packets; i++)
+			s->bytes += t->iso_packet_desc[i].actual_length;
+	} else {
+		s->bytes += t->actual_length;
+	}
+	if (s->lat)
+		hist_add(s->lat, s->t_end - c->t_submit);
+
+	if (s->n_iso && (s->ep & 0x80) && s->iso && s->iso(s, t)) {
+		s->stop = 1;
+		stream_cancel(s);
+		return;
+	}
+	/* ring slots are written out by the ring's thread only */
+	if (!s->n_iso && !s->ring && (s->ep & 0x80) && s->drain &&
+	    s->drain(s, t->buffer, t->actual_length)) {
+		s->stop = 1;
+		stream_cancel(s);
+		return;
+	}
+
+	stream_submit(s, t);
+}
+
+int stream_init(struct stream *s)
+{
+	unsigned i;
+
+	if (s->n_iso)
+		s->len = s->n_iso * s->iso_len;
+	if (s->ring && (~s->ep & 0x80 || s->ring->slot_size < s->len ||
+	                s->n_iso)) {
+		fprintf(stderr, "ring buffers require a bulk IN endpoint and "
+			"slots of at least %u bytes\n", s->len);
+		return 1;
+	}
+
+	s->n_dev_mem = 0;
+	s->tfers = calloc(s->depth, sizeof(*s->tfers));
+	s->tctx = calloc(s->depth, sizeof(*s->tctx));
+	s->parked = calloc(s->depth, sizeof(*s->parked));
+	if (!s->tfers || !s->tctx || !s->parked) {
+		free(s->tfers);
+		free(s->tctx);
+		free(s->parked);
+		s->tfers = NULL;
+		s->tctx = NULL;
+		s->parked = NULL;
+		return 1;
+	}
+	for (i=0; i<s->depth; i++) {
+		struct libusb_transfer *t = libusb_alloc_transfer(s->n_iso);
+		int dev_mem = 0;
+		/* ring slots are assigned on submission */
+		uint8_t *buf = s->ring ? NULL
+		             : stream_buf_alloc(s->hdev, s->len, s->zerocopy,
+		                                &dev_mem);
+		if (!t || (!buf && !s->ring)) {
+			fprintf(stderr, "error allocating %u transfers of "
+				"%u bytes\n", s->depth, s->len);
+			libusb_free_transfer(t);
+			if (buf)
+				stream_buf_free(s->hdev, buf, s->len, dev_mem);
+			stream_fini(s);
+			return 1;
+		}
+		s->tctx[i].s = s;
+		s->tctx[i].dev_mem = dev_mem;
+		s->n_dev_mem += dev_mem;
+		if (s->n_iso) {
+			libusb_fill_iso_transfer(t, s->hdev, s->ep, buf,
+			                         s->len, s->n_iso, stream_cb,
+			                         &s->tctx[i], s->timeout);
+			libusb_set_iso_packet_lengths(t, s->iso_len);
+		} else {
+			libusb_fill_bulk_transfer(t, s->hdev, s->ep, buf,
+			                          s->len, stream_cb,
+			                          &s->tctx[i], s->timeout);
+		}
+		s->tfers[i] = t;
+	}
+	s->n_parked = 0;
+	s->in_flight = 0;
+	s->submitted = 0;
+	s->stop = 0;
+	s->err = 0;
+	s->gone = 0;
+	s->completed = 0;
+	s->bytes = 0;
+	s->errors = 0;
+	s->timeouts = 0;
+	return 0;
+}
+
+void stream_fini(struct stream *s)
+{
+	unsigned i;
+
+	if (!s->tfers)
+		return;
+	for (i=0; i<s->depth && s->tfers[i]; i++) {
+		if (!s->ring)
+			stream_buf_free(s->hdev, s->tfers[i]->buffer, s->len,
+			                s->tctx[i].dev_mem);
+		libusb_free_transfer(s->tfers[i]);
+	}
+	free(s->tfers);
+	free(s->tctx);
+	free(s->parked);
+	s->tfers = NULL;
+	s->tctx = NULL;
+	s->parked = NULL;
+}
+
+int stream_start(struct stream *s)
+{
+	unsigned i;
+
+	s->t_start = s->t_end = mono_ns();
+	s->t_stop = s->duration > 0 ? s->t_start + s->duration * 1e9 : 0;
+	for (i=0; i<s->depth; i++)
+		stream_submit(s, s->tfers[i]);
+	return s->err;
+}
+
+void stream_cancel(struct stream *s)
+{
+	unsigned i;
+
+	s->stop = 1;
+	s->n_parked = 0;
+	if (!s->tfers)
+		return;
+	/* transfers not in flight report LIBUSB_ERROR_NOT_FOUND, ignore */
+	for (i=0; i<s->depth; i++)
+		libusb_cancel_transfer(s->tfers[i]);
+}
+
+/* retries transfers held back because the ring was full */
+static void stream_unpark(struct stream *s)
+{
+	unsigned i, n = s->n_parked;
+
+	s->n_parked = 0;
+	for (i=0; i<n; i++)
+		stream_submit(s, s->parked[i]);
+}
+
+/* services all streams from one event loop until none has transfers left in
+ * flight; an error on any stream stops all of them */
+int stream_run_all(libusb_context *ctx, struct stream **ss, unsigned n)
+{
+	unsigned i, in_flight, parked;
+	int r, err = 0;
+
+	for (i=0; i<n; i++)
+		if (stream_start(ss[i]))
+			break;
+
+	while (1) {
+		in_flight = parked = 0;
+		for (i=0; i<n; i++) {
+			if (!err && ss[i]->err)
+				err = ss[i]->err;
+			if (ss[i]->n_parked)
+				stream_unpark(ss[i]);
+			in_flight += ss[i]->in_flight;
+			parked += ss[i]->n_parked;
+		}
+		if (err)
+			for (i=0; i<n; i++)
+				if (!ss[i]->stop)
+					stream_cancel(ss[i]);
+		if (!in_flight && !parked)
+			break;
+		if (stream_report_req) {
+			stream_report_req = 0;
+			for (i=0; i<n; i++)
+				stream_report(ss[i], stderr);
+		}
+		if (parked)
+			/* poll until the writers free up slots */
+			r = libusb_handle_events_timeout(ctx,
+				&(struct timeval){ 0, 1000 });
+		else
+			r = libusb_handle_events(ctx);
+		if (r && r != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "error handling USB events: %s\n",
+				libusb_error_name(r));
+			for (i=0; i<n; i++)
+				stream_fail(ss[i], 6);
+		}
+	}
+
+	for (i=0; i<n; i++)
+		if (!err && ss[i]->err)
+			err = ss[i]->err;
+	return err;
+}
+
+int stream_run(libusb_context *ctx, struct stream *s)
+{
+	return stream_run_all(ctx, &s, 1);
+}
+
+void stream_report(const struct stream *s, FILE *f)
+{
+	double dt = (s->t_end - s->t_start) * 1e-9;
+
+	fprintf(f, "ep 0x%02x: %" PRIu64 " transfers, %" PRIu64 " bytes in "
+		"%.3f s: %.2f MB/s\n", s->ep, s->completed, s->bytes, dt,
+		dt > 0 ? s->bytes / dt * 1e-6 : 0);
+	if (s->errors)
+		fprintf(f, "ep 0x%02x: %" PRIu64 " failed transfers, %" PRIu64
+			" of which timed out\n", s->ep, s->errors,
+			s->timeouts);
+	if (s->zerocopy && !s->ring)
+		fprintf(f, "ep 0x%02x: %u of %u transfer buffers zero-copy "
+			"(usbfs mmap)%s\n", s->ep, s->n_dev_mem, s->depth,
+			s->n_dev_mem < s->depth ? ", rest on the heap" : "");
+	if (s->lat) {
+		char name[16];
+		snprintf(name, sizeof(name), "ep 0x%02x", s->ep);
+		hist_report(s->lat, name, f);
+	}
+}
+
+/* one line per transfer: ep, submission and completion time in ns of
+ * CLOCK_MONOTONIC, status, bytes transferred */
+void stream_log(FILE *f, unsigned ep, uint64_t t_submit, uint64_t t_complete,
+                const char *status, unsigned len)
+{
+	fprintf(f, "0x%02x %" PRIu64 " %" PRIu64 " %s %u\n",
+		ep, t_submit, t_complete, status, len);
+}
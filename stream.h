@@ -0,0 +1,100 @@
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <libusb.h>
+
+#include "hist.h"
+#include "ring.h"
+
+struct stream;
+
+/* Supplies the payload of the next OUT transfer. Returns the number of bytes
+ * placed into buf (<= len), 0 on end of input or < 0 on error. */
+typedef int stream_fill_f(struct stream *s, uint8_t *buf, unsigned len);
+
+/* Consumes the payload of a completed IN transfer. Returns 0 to continue
+ * streaming, anything else stops the stream. */
+typedef int stream_drain_f(struct stream *s, const uint8_t *buf, unsigned len);
+
+/* Consumes a completed isochronous IN transfer, packet by packet. Returns 0 to
+ * continue streaming, anything else stops the stream. */
+typedef int stream_iso_f(struct stream *s, const struct libusb_transfer *t);
+
+struct stream {
+	/* configuration */
+	libusb_device_handle *hdev;
+	uint8_t ep;		/* direction: (ep & 0x80) ? IN : OUT */
+	unsigned len;		/* bytes per transfer, see n_iso */
+	unsigned depth;		/* number of transfers kept in flight */
+	unsigned timeout;	/* ms, 0: none */
+	long n;			/* transfers to complete, < 0: infinite */
+	stream_fill_f *fill;
+	stream_drain_f *drain;
+	unsigned n_iso;		/* > 0: isochronous packets per transfer */
+	unsigned iso_len;	/* bytes per packet, len = n_iso * iso_len */
+	stream_iso_f *iso;	/* replaces drain for isochronous streams */
+	struct ring *ring;	/* IN only: transfer into ring slots, no drain */
+	struct hist *lat;	/* submission to completion latency in ns */
+	FILE *ts_log;		/* per-transfer timestamps, see stream_log() */
+	double duration;	/* stop submitting after seconds, 0: never */
+	int keep_going;		/* count failed transfers instead of stopping */
+	int zerocopy;		/* try libusb_dev_mem_alloc() for buffers */
+	void *priv;
+
+	/* state */
+	struct libusb_transfer **tfers;
+	struct stream_tfer {
+		struct stream *s;
+		uint64_t t_submit;
+		int dev_mem;
+	} *tctx;
+	struct libusb_transfer **parked;	/* waiting for a ring slot */
+	unsigned n_parked;
+	unsigned in_flight;
+	long submitted;
+	int stop;
+	int err;		/* 0 on success */
+	int gone;		/* stopped because the device disappeared */
+	unsigned n_dev_mem;	/* buffers allocated by libusb_dev_mem_alloc() */
+	uint64_t t_stop;
+
+	/* statistics */
+	uint64_t completed;
+	uint64_t bytes;
+	uint64_t errors;	/* failed transfers, incl. timeouts */
+	uint64_t timeouts;
+	uint64_t t_start, t_end;	/* ns, see mono_ns() */
+};
+
+#define STREAM_INIT(hdev_,ep_,len_,depth_,timeout_,n_) \
+	{ .hdev = (hdev_), .ep = (ep_), .len = (len_), .depth = (depth_), \
+	  .timeout = (timeout_), .n = (n_), }
+
+/* set asynchronously, e.g. by a signal handler, to have stream_run_all()
+ * print the latency histograms of all streams */
+extern volatile sig_atomic_t stream_report_req;
+
+int stream_init(struct stream *s);
+void stream_fini(struct stream *s);
+
+int stream_start(struct stream *s);
+void stream_cancel(struct stream *s);
+int stream_run(libusb_context *ctx, struct stream *s);
+int stream_run_all(libusb_context *ctx, struct stream **ss, unsigned n);
+
+void stream_report(const struct stream *s, FILE *f);
+void stream_log(FILE *f, unsigned ep, uint64_t t_submit, uint64_t t_complete,
+                const char *status, unsigned len);
+
+uint8_t * stream_buf_alloc(libusb_device_handle *hdev, size_t len,
+                           int zerocopy, int *dev_mem);
+void stream_buf_free(libusb_device_handle *hdev, uint8_t *buf, size_t len,
+                     int dev_mem);
+
+const char * stream_status_name(enum libusb_transfer_status status);
+
+#endif
@@ -0,0 +1,69 @@
+#define _POSIX_C_SOURCE		200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getpid() */
+#include <pthread.h>
+
+#include "trace.h"
+
+FILE *trace_file;
+
+/* events are written from the workers in fleet and hotplug mode, too */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local unsigned trace_tid;
+static unsigned trace_n_tids;
+static int trace_pid;
+static int trace_n_events;
+
+static void trace_fini(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_init(void)
+{
+	const char *path = getenv(ENV_TRACE);
+
+	if (trace_file || !path || !*path)
+		return;
+	if (!(trace_file = fopen(path, "w"))) {
+		fprintf(stderr, "error opening trace file %s: %s\n", path,
+			strerror(errno));
+		return;
+	}
+	trace_pid = getpid();
+	fputc('[', trace_file);
+	atexit(trace_fini);
+}
+
+void trace_span(const char *cat, const char *name, uint64_t t0, uint64_t t1,
+                const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_file)
+		goto out;
+	if (!trace_tid)
+		trace_tid = ++trace_n_tids;
+	fprintf(trace_file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+		"\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+		trace_n_events++ ? "," : "", name, cat, trace_pid, trace_tid,
+		t0 * 1e-3, (t1 - t0) * 1e-3);
+	if (fmt) {
+		va_start(ap, fmt);
+		vfprintf(trace_file, fmt, ap);
+		va_end(ap);
+	}
+	fputs("}}", trace_file);
+out:
+	pthread_mutex_unlock(&trace_lock);
+}
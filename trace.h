@@ -0,0 +1,40 @@
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "common.h"		/* mono_ns() */
+
+#define ENV_TRACE		"USB_TRACE"
+
+/* Phase and transfer tracing in Chrome's trace-event JSON format, to be
+ * loaded into chrome://tracing or Perfetto. Enabled by naming the output file
+ * in $USB_TRACE; while trace_file is NULL all of the below reduce to a test of
+ * that pointer. */
+extern FILE *trace_file;
+
+/* opens $USB_TRACE once, the file is completed at exit */
+void trace_init(void);
+
+/* timestamp starting a span, 0 while tracing is off */
+static inline uint64_t trace_begin(void)
+{
+	return trace_file ? mono_ns() : 0;
+}
+
+/* records a complete event [t0,t1) in ns; fmt and the following arguments
+ * produce the members of its "args" object, e.g. "\"len\":%u", or NULL */
+void trace_span(const char *cat, const char *name, uint64_t t0, uint64_t t1,
+                const char *fmt, ...) __attribute__((format(printf,5,6)));
+
+/* ends the span started at t0 by trace_begin() now */
+#define trace_end(cat, name, t0, ...)                                          \
+	do {                                                                   \
+		if (trace_file)                                                \
+			trace_span((cat), (name), (t0), mono_ns(),             \
+			           __VA_ARGS__);                               \
+	} while (0)
+
+#endif
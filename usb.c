@@ -2,6 +2,7 @@
 #define _POSIX_C_SOURCE		201501L
 
 #include <unistd.h>
+#include <fcntl.h>	/* open() */
 #include <libusb.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -9,6 +10,11 @@
 #include <string.h>
 
 #include "usb.h"
+#include "trace.h"
+
+FILE *usb_msg_out;
+
+#define USB_MSG_OUT	(usb_msg_out ? usb_msg_out : stderr)
 /*
 extern const char *usage;
 extern int min_argc, max_argc;
@@ -17,12 +23,14 @@ int run_usb(libusb_context *ctx, libusb_device_handle *hdev, int argc, char **ar
 libusb_device ** usb_common_get_device_list(libusb_context *ctx)
 {
 	libusb_device **devs = NULL;
+	uint64_t t0 = trace_begin();
 	ssize_t ndevs = libusb_get_device_list(ctx, &devs);
+	trace_end("setup", "get_device_list", t0, "\"devices\":%zd", ndevs);
 	if (ndevs < 0) {
-		fprintf(stderr, "error enumerating USB devices: %s\n",
+		fprintf(USB_MSG_OUT, "error enumerating USB devices: %s\n",
 			libusb_error_name(ndevs));
 	} else if (!ndevs) {
-		fprintf(stderr, "error: no USB devices found\n");
+		fprintf(USB_MSG_OUT, "error: no USB devices found\n");
 	}
 	return devs;
 }
@@ -34,6 +42,89 @@ static int usb_desc_eq_vid_pid(
 	return desc->idVendor == addr[0] && desc->idProduct == addr[1];
 }
 
+/* determines the device type of dev and reports the device to be used */
+static void usb_announce_device(
+	libusb_device *dev, const addr_t addr, struct dev_spec *spec,
+	const struct dev_type *dev_types, unsigned n_dev_types
+) {
+	struct libusb_device_descriptor desc;
+	unsigned i;
+
+	libusb_get_device_descriptor(dev, &desc);
+	for (i=0; i<n_dev_types; i++)
+		if (usb_desc_eq_vid_pid(&desc, dev_types[i].addr)) {
+			spec->dev_type = dev_types + i;
+			break;
+		}
+	fprintf(USB_MSG_OUT, "using %s device %04hx:%04hx on bus.addr %hu.%hu\n",
+		spec->dev_type ? spec->dev_type->name : "unknown",
+		desc.idVendor, desc.idProduct, addr[0], addr[1]);
+}
+
+/* Fast path for <bus>.<addr>: opens the usbfs node directly instead of
+ * enumerating all devices. Returns NULL if that is not possible, then
+ * usb_common_find_device() has to be used. */
+static libusb_device_handle * usb_common_open_sys(struct usb_common *uc)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000107
+	libusb_device_handle *hdev;
+	char path[32];
+	uint64_t t0 = trace_begin();
+	int fd;
+
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03hu/%03hu",
+	         uc->spec.bus_addr[0], uc->spec.bus_addr[1]);
+	if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+		return NULL;
+	if (libusb_wrap_sys_device(uc->ctx, fd, &hdev)) {
+		close(fd);
+		return NULL;
+	}
+	uc->sys_fd = fd;
+	trace_end("setup", "open-fd", t0, NULL);
+	usb_announce_device(libusb_get_device(hdev), uc->spec.bus_addr,
+	                    &uc->spec, uc->dev_types, uc->n_dev_types);
+	return hdev;
+#else
+	return NULL;
+#endif
+}
+
+/* with <bus>.<addr> given, libusb does not need to discover all devices */
+static int usb_common_init(struct usb_common *uc)
+{
+	uint64_t t0 = trace_begin();
+	int r;
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x0100010A
+	if (uc->spec.have_bus_addr) {
+		struct libusb_init_option opt = {
+			.option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY,
+		};
+		if (!libusb_init_context(&uc->ctx, &opt, 1)) {
+			uc->no_discovery = 1;
+			trace_end("setup", "init", t0, "\"discovery\":false");
+			return 0;
+		}
+	}
+#endif
+	uc->no_discovery = 0;
+	r = libusb_init(&uc->ctx);
+	trace_end("setup", "init", t0, "\"discovery\":true");
+	return r;
+}
+
+/* closes the handle and, if wrapped, the usbfs node */
+static void usb_common_close(struct usb_common *uc)
+{
+	if (uc->hdev)
+		libusb_close(uc->hdev);
+	if (uc->sys_fd >= 0)
+		close(uc->sys_fd);
+	uc->hdev = NULL;
+	uc->sys_fd = -1;
+}
+
 libusb_device_handle * usb_common_find_device(
 	libusb_context *ctx, struct dev_spec *spec,
 	const struct dev_type *dev_types, unsigned n_dev_types
@@ -44,12 +135,14 @@ libusb_device_handle * usb_common_find_device(
 	addr_t addr;
 	const addr_t *a;
 	unsigned i;
+	uint64_t t0;
 	int r;
 
 	devs = usb_common_get_device_list(ctx);
 	if (!devs)
 		return NULL;
 
+	t0 = trace_begin();
 	for (j = devs; *j; j++) {
 		addr[0] = libusb_get_bus_number(*j);
 		addr[1] = libusb_get_device_address(*j);
@@ -59,7 +152,7 @@ libusb_device_handle * usb_common_find_device(
 		} else {
 			r = libusb_get_device_descriptor(*j, &desc);
 			if (r) {
-				fprintf(stderr,
+				fprintf(USB_MSG_OUT,
 					"warning: unable to access descriptor "
 					"of device on %hu.%hu: %s\n",
 					addr[0], addr[1], libusb_error_name(r));
@@ -89,7 +182,7 @@ found:
 			continue;
 		}
 		/* not unique */
-		fprintf(stderr,
+		fprintf(USB_MSG_OUT,
 			"ambigious device specifier: "
 			"both %hhu.%hhu and %hu.%hu match\n",
 			libusb_get_bus_number(dev),
@@ -97,23 +190,18 @@ found:
 			addr[0], addr[1]);
 		goto out;
 	}
+	trace_end("setup", "match", t0, NULL);
 	if (!dev) {
-		fprintf(stderr, "no matching USB device found\n");
+		fprintf(USB_MSG_OUT, "no matching USB device found\n");
 	} else {
-		r = libusb_get_device_descriptor(dev, &desc);
-		for (i=0; i<n_dev_types; i++)
-			if (usb_desc_eq_vid_pid(&desc, dev_types[i].addr)) {
-				spec->dev_type = dev_types + i;
-				break;
-			}
-		fprintf(stderr, "using %s device %04hx:%04hx on bus.addr %hhu.%hhu\n",
-			spec->dev_type ? spec->dev_type->name : "unknown",
-			desc.idVendor, desc.idProduct,
-			libusb_get_bus_number(dev),
-			libusb_get_device_address(dev));
+		addr[0] = libusb_get_bus_number(dev);
+		addr[1] = libusb_get_device_address(dev);
+		usb_announce_device(dev, addr, spec, dev_types, n_dev_types);
+		t0 = trace_begin();
 		r = libusb_open(dev, &hdev);
+		trace_end("setup", "open", t0, NULL);
 		if (r) {
-			fprintf(stderr, "error opening device: %s\n",
+			fprintf(USB_MSG_OUT, "error opening device: %s\n",
 				libusb_error_name(r));
 		}
 	}
@@ -123,7 +211,40 @@ out:
 	return hdev;
 }
 
-static int parse_dev_spec(struct dev_spec *spec, const char *dev_addr)
+/* looks up the interface and alt-setting of the active configuration that
+ * provide endpoint ep, returns 0 on success */
+int usb_common_find_ep(
+	libusb_device_handle *hdev, uint8_t ep, int *iface, int *alt
+) {
+	struct libusb_config_descriptor *cfg;
+	const struct libusb_interface_descriptor *id;
+	int i, j, k, r;
+
+	r = libusb_get_active_config_descriptor(libusb_get_device(hdev), &cfg);
+	if (r) {
+		fprintf(stderr, "error reading configuration descriptor: %s\n",
+			libusb_error_name(r));
+		return 1;
+	}
+	for (i=0; i<cfg->bNumInterfaces; i++)
+		for (j=0; j<cfg->interface[i].num_altsetting; j++) {
+			id = &cfg->interface[i].altsetting[j];
+			for (k=0; k<id->bNumEndpoints; k++)
+				if (id->endpoint[k].bEndpointAddress == ep) {
+					*iface = id->bInterfaceNumber;
+					*alt = id->bAlternateSetting;
+					goto found;
+				}
+		}
+	fprintf(stderr, "endpoint 0x%02hhx not found in active configuration\n",
+		ep);
+	r = 1;
+found:
+	libusb_free_config_descriptor(cfg);
+	return r;
+}
+
+int usb_common_parse_spec(struct dev_spec *spec, const char *dev_addr)
 {
 	addr_t *addr;
 	const char *delim = dev_addr + strcspn(dev_addr, ".:");
@@ -142,7 +263,7 @@ static int parse_dev_spec(struct dev_spec *spec, const char *dev_addr)
 		break;
 	}
 	if (!fmt || sscanf(dev_addr, fmt, *addr + 0, *addr + 1) != 2) {
-		fprintf(stderr,"invalid device address: '%s'\n",dev_addr);
+		fprintf(USB_MSG_OUT,"invalid device address: '%s'\n",dev_addr);
 		return 1;
 	}
 	return 0;
@@ -151,7 +272,11 @@ static int parse_dev_spec(struct dev_spec *spec, const char *dev_addr)
 static const char *usb_common_dev_spec_help = "\
   -c <bus>.<addr> N: bus #, M: device # (see /sys/bus/usb/devices/N-*/devnum)\n\
      <vid>:<pid>  address USB device via a Vendor / Product ID pair\n\
-                  both formats override " ENV_DEV_ADDR "= in environment\n\
+                  both formats override " ENV_DEV_ADDR "= in environment;\n\
+                  <bus>.<addr> opens /dev/bus/usb/<bus>/<addr> directly\n\
+                  set " ENV_SETUP_TIMES "= to print the time of each setup phase\n\
+                  set " ENV_TRACE "=<file> to write a Chrome trace-event JSON\n\
+                  of all phases and transfers to <file>\n\
 ";
 static const char *usb_common_dev_type_help = "\
   -t <dev-type>   use Vendor / Product ID pair identified by shortcut <dev-type>\n\
@@ -252,6 +377,7 @@ int usb_common_parse_opts(struct usb_common *uc, int argc, char **argv)
 	int iface = 0;
 	int alt_iface = -1;
 
+	trace_init();
 	while ((opt = getopt(argc, argv, ":c:t:")) != -1)
 		switch (opt) {
 		case 'c': dev_addr = optarg; break;
@@ -261,7 +387,7 @@ int usb_common_parse_opts(struct usb_common *uc, int argc, char **argv)
 		}
 
 done_opt_parsing:
-	if (dev_addr && (r = parse_dev_spec(&uc->spec, dev_addr)))
+	if (dev_addr && (r = usb_common_parse_spec(&uc->spec, dev_addr)))
 		return r;
 	if (dev_type) {
 		const struct dev_type *t = NULL, *tt;
@@ -285,46 +411,104 @@ done_opt_parsing:
 	return 0;
 }
 
+static int usb_common_claim(struct usb_common *uc)
+{
+	uint64_t t0 = trace_begin();
+	int r;
+
+	if (uc->iface > -1) {
+		r = libusb_claim_interface(uc->hdev, uc->iface);
+		trace_end("setup", "claim", t0, "\"iface\":%d", uc->iface);
+		if (r) {
+			fprintf(stderr, "error claiming interface %d: %s\n",
+				uc->iface, libusb_error_name(r));
+			uc->iface = -1;
+			return 3;
+		}
+		t0 = trace_begin();
+		if (uc->alt > -1 &&
+		    (r = libusb_set_interface_alt_setting(uc->hdev, uc->iface,
+		                                          uc->alt))) {
+			fprintf(stderr,
+				"error setting alt-setting %d on interface %d: "
+				"%s\n", uc->alt, uc->iface,
+				libusb_error_name(r));
+			return 4;
+		}
+		if (uc->alt > -1)
+			trace_end("setup", "alt-setting", t0, "\"alt\":%d",
+			          uc->alt);
+	}
+
+	return 0;
+}
+
+static void usb_setup_time(const char *phase, uint64_t *t)
+{
+	uint64_t now = mono_ns();
+
+	fprintf(stderr, "setup: %-8s %8.3f ms\n", phase, (now - *t) * 1e-6);
+	*t = now;
+}
+
 int usb_common_setup(struct usb_common *uc)
 {
 	int r = 0;
+	int times = getenv(ENV_SETUP_TIMES) != NULL;
+	uint64_t t = times ? mono_ns() : 0;
+	uint64_t t0 = trace_begin();
 
 	/* init libusb */
-	r = libusb_init(&uc->ctx);
+	r = usb_common_init(uc);
 	if (r) {
 		fprintf(stderr, "error initializing libusb: %s\n",
 			libusb_error_name(r));
+		uc->ctx = NULL;
 		r = 1;
 		goto err;
 	}
+	if (times)
+		usb_setup_time(uc->no_discovery ? "init-nd" : "init", &t);
 
 	/* find specified USB device */
-	uc->hdev = usb_common_find_device(uc->ctx, &uc->spec,
-	                                  uc->dev_types, uc->n_dev_types);
+	if (uc->spec.have_bus_addr)
+		uc->hdev = usb_common_open_sys(uc);
+	if (!uc->hdev && uc->no_discovery) {
+		/* fall back to enumeration */
+		uint64_t t1 = trace_begin();
+		libusb_exit(uc->ctx);
+		uc->no_discovery = 0;
+		r = libusb_init(&uc->ctx);
+		trace_end("setup", "re-init", t1, NULL);
+		if (r) {
+			fprintf(stderr, "error initializing libusb: %s\n",
+				libusb_error_name(r));
+			uc->ctx = NULL;
+			r = 1;
+			goto err;
+		}
+		if (times)
+			usb_setup_time("re-init", &t);
+	}
+	if (!uc->hdev)
+		uc->hdev = usb_common_find_device(uc->ctx, &uc->spec,
+		                                  uc->dev_types,
+		                                  uc->n_dev_types);
 	if (!uc->hdev) {
 		r = 2;
 		goto err;
 	}
+	uc->dev = libusb_ref_device(libusb_get_device(uc->hdev));
+	if (times)
+		usb_setup_time(uc->sys_fd >= 0 ? "open-fd" : "find", &t);
 
-	if (uc->iface > -1) {
-		if ((r = libusb_claim_interface(uc->hdev, uc->iface))) {
-			fprintf(stderr, "error claiming interface %d: %s\n",
-				uc->iface, libusb_error_name(r));
-			uc->iface = -1;
-			r = 3;
-			goto err;
-		}
-		if (uc->alt > -1 &&
-		    (r = libusb_set_interface_alt_setting(uc->hdev, uc->iface,
-		                                          uc->alt))) {
-			fprintf(stderr,
-				"error setting alt-setting %d on interface %d: "
-				"%s\n", uc->alt, uc->iface,
-				libusb_error_name(r));
-			r = 4;
-			goto err;
-		}
-	}
+	if ((r = usb_common_claim(uc)))
+		goto err;
+	if (times)
+		usb_setup_time("claim", &t);
+	trace_end("setup", "setup", t0, "\"bus\":%u,\"addr\":%u",
+	          libusb_get_bus_number(uc->dev),
+	          libusb_get_device_address(uc->dev));
 
 	return 0;
 
@@ -337,10 +521,391 @@ void usb_common_teardown(struct usb_common *uc)
 {
 	if (uc->hdev && uc->iface > -1)
 		libusb_release_interface(uc->hdev, uc->iface);
-	if (uc->hdev)
-		libusb_close(uc->hdev);
+	usb_common_close(uc);
+	if (uc->dev)
+		libusb_unref_device(uc->dev);
 	if (uc->ctx)
 		libusb_exit(uc->ctx);
+	uc->dev = NULL;
+	uc->ctx = NULL;
+}
+
+/* releases the device for others to use while keeping what is needed to
+ * quickly get it back via usb_common_resume() */
+void usb_common_suspend(struct usb_common *uc, enum usb_keep keep)
+{
+	if (keep == USB_KEEP_NONE) {
+		usb_common_teardown(uc);
+		return;
+	}
+	if (uc->hdev && uc->iface > -1)
+		libusb_release_interface(uc->hdev, uc->iface);
+	if (keep == USB_KEEP_DEVICE)
+		usb_common_close(uc);
+}
+
+/* reverts usb_common_suspend(), equivalent to usb_common_setup() if nothing
+ * was kept */
+int usb_common_resume(struct usb_common *uc)
+{
+	int r;
+
+	if (!uc->ctx)
+		return usb_common_setup(uc);
+
+	if (!uc->hdev && (r = libusb_open(uc->dev, &uc->hdev))) {
+		fprintf(stderr, "error re-opening device: %s\n",
+			libusb_error_name(r));
+		uc->hdev = NULL;
+		r = 2;
+		goto err;
+	}
+	if ((r = usb_common_claim(uc)))
+		goto err;
+
+	return 0;
+
+err:
+	usb_common_teardown(uc);
+	return r;
+}
+
+/* records what is needed to find the opened device again after it
+ * re-enumerated */
+int usb_common_identify(struct usb_common *uc, struct usb_ident *id)
+{
+	struct libusb_device_descriptor desc;
+	int r;
+
+	memset(id, 0, sizeof(*id));
+	r = libusb_get_device_descriptor(uc->dev, &desc);
+	if (r) {
+		fprintf(stderr, "error reading device descriptor: %s\n",
+			libusb_error_name(r));
+		return 1;
+	}
+	id->vid_pid[0] = desc.idVendor;
+	id->vid_pid[1] = desc.idProduct;
+	if (desc.iSerialNumber &&
+	    libusb_get_string_descriptor_ascii(uc->hdev, desc.iSerialNumber,
+	                                       (uint8_t *)id->serial,
+	                                       sizeof(id->serial) - 1) < 0)
+		id->serial[0] = '\0';
+	return 0;
+}
+
+/* candidates collected by usb_arrived(), checked outside of the callback */
+struct usb_arrivals {
+	libusb_device *devs[16];
+	unsigned n;
+};
+
+static int LIBUSB_CALL usb_arrived(
+	libusb_context *ctx, libusb_device *dev, libusb_hotplug_event ev,
+	void *arg
+) {
+	struct usb_arrivals *a = arg;
+	if (a->n < ARRAY_SIZE(a->devs))
+		a->devs[a->n++] = libusb_ref_device(dev);
+	return 0;
+}
+
+/* opens dev if it is the one identified by id */
+static libusb_device_handle * usb_match_ident(
+	libusb_device *dev, const struct usb_ident *id
+) {
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *hdev;
+	char serial[sizeof(id->serial)];
+
+	if (libusb_get_device_descriptor(dev, &desc) ||
+	    desc.idVendor != id->vid_pid[0] || desc.idProduct != id->vid_pid[1])
+		return NULL;
+	if (libusb_open(dev, &hdev))
+		return NULL;
+	if (!id->serial[0])
+		return hdev;
+	if (desc.iSerialNumber &&
+	    libusb_get_string_descriptor_ascii(hdev, desc.iSerialNumber,
+	                                       (uint8_t *)serial,
+	                                       sizeof(serial) - 1) > 0 &&
+	    !strncmp(serial, id->serial, sizeof(serial) - 1))
+		return hdev;
+	libusb_close(hdev);
+	return NULL;
+}
+
+/* waits for the device identified by id to (re-)appear, e.g. after a
+ * brown-out, then re-opens it and claims the interface again; timeout_ms == 0
+ * waits forever */
+int usb_common_reattach(
+	struct usb_common *uc, const struct usb_ident *id, unsigned timeout_ms
+) {
+	struct usb_arrivals a = { .n = 0, };
+	libusb_hotplug_callback_handle cb;
+	libusb_device **devs, **j;
+	uint64_t deadline = mono_ns() + timeout_ms * UINT64_C(1000000);
+	int hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+	int r;
+	unsigned i;
+
+	/* the old device is gone, releasing it is expected to fail */
+	if (uc->hdev && uc->iface > -1)
+		libusb_release_interface(uc->hdev, uc->iface);
+	usb_common_close(uc);
+	if (uc->dev)
+		libusb_unref_device(uc->dev);
+	uc->dev = NULL;
+
+	if (uc->no_discovery) {
+		/* hotplug and the device list need discovery */
+		libusb_exit(uc->ctx);
+		uc->no_discovery = 0;
+		if ((r = libusb_init(&uc->ctx))) {
+			fprintf(stderr, "error initializing libusb: %s\n",
+				libusb_error_name(r));
+			uc->ctx = NULL;
+			return 1;
+		}
+	}
+
+	if (hotplug &&
+	    (r = libusb_hotplug_register_callback(uc->ctx,
+	                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+	                LIBUSB_HOTPLUG_ENUMERATE, id->vid_pid[0],
+	                id->vid_pid[1], LIBUSB_HOTPLUG_MATCH_ANY,
+	                usb_arrived, &a, &cb))) {
+		fprintf(stderr, "error registering hotplug callback: %s\n",
+			libusb_error_name(r));
+		hotplug = 0;
+	}
+
+	while (!uc->hdev && (!timeout_ms || mono_ns() < deadline)) {
+		if (hotplug) {
+			libusb_handle_events_timeout(uc->ctx,
+				&(struct timeval){ 0, 100000 });
+		} else {
+			/* no hotplug support, poll the device list */
+			nanosleep(&(struct timespec){ 0, 100000000 }, NULL);
+			if (libusb_get_device_list(uc->ctx, &devs) < 0)
+				continue;
+			/* the whole list, it may be longer than a.devs */
+			for (j = devs; *j && !uc->hdev; j++)
+				if ((uc->hdev = usb_match_ident(*j, id)))
+					uc->dev = libusb_ref_device(*j);
+			libusb_free_device_list(devs, 1);
+		}
+		for (i=0; i<a.n; i++) {
+			if (!uc->hdev &&
+			    (uc->hdev = usb_match_ident(a.devs[i], id)))
+				uc->dev = libusb_ref_device(a.devs[i]);
+			libusb_unref_device(a.devs[i]);
+		}
+		a.n = 0;
+	}
+
+	if (hotplug)
+		libusb_hotplug_deregister_callback(uc->ctx, cb);
+
+	if (!uc->hdev) {
+		fprintf(stderr, "timeout waiting for device %04hx:%04hx to "
+			"re-appear\n", id->vid_pid[0], id->vid_pid[1]);
+		return 2;
+	}
+	fprintf(stderr, "re-attached device %04hx:%04hx on bus.addr "
+		"%hhu.%hhu\n", id->vid_pid[0], id->vid_pid[1],
+		libusb_get_bus_number(uc->dev),
+		libusb_get_device_address(uc->dev));
+	return usb_common_claim(uc);
+}
+
+struct usb_departure {
+	addr_t bus_addr;
+	uint64_t t;		/* 0: still there */
+	addr_t *present;	/* other devices with the new VID:PID at start */
+	unsigned n_present;
+};
+
+static int LIBUSB_CALL usb_departed(
+	libusb_context *ctx, libusb_device *dev, libusb_hotplug_event ev,
+	void *arg
+) {
+	struct usb_departure *d = arg;
+	if (!d->t && libusb_get_bus_number(dev) == d->bus_addr[0] &&
+	    libusb_get_device_address(dev) == d->bus_addr[1])
+		d->t = mono_ns();
+	return 0;
+}
+
+/* the renumerated device: vid_pid, seen after the old one has left and not
+ * one of those attached already, e.g. other boards running that firmware */
+static int usb_renum_match(
+	libusb_device *dev, const struct usb_departure *d, const addr_t vid_pid
+) {
+	struct libusb_device_descriptor desc;
+	unsigned i;
+
+	if (!d->t)
+		return 0;
+	for (i=0; i<d->n_present; i++)
+		if (libusb_get_bus_number(dev) == d->present[i][0] &&
+		    libusb_get_device_address(dev) == d->present[i][1])
+			return 0;
+	return !libusb_get_device_descriptor(dev, &desc) &&
+	       usb_desc_eq_vid_pid(&desc, vid_pid);
+}
+
+/* records the devices matching vid_pid other than the old one, notes the
+ * departure if that is gone already */
+static int usb_renum_snapshot(
+	libusb_context *ctx, struct usb_departure *d, const addr_t vid_pid
+) {
+	struct libusb_device_descriptor desc;
+	libusb_device **devs, **j;
+	ssize_t n = libusb_get_device_list(ctx, &devs);
+	int old = 0;
+
+	if (n < 0) {
+		fprintf(stderr, "error listing devices: %s\n",
+			libusb_error_name(n));
+		return 1;
+	}
+	if (!(d->present = calloc(n ? n : 1, sizeof(*d->present)))) {
+		libusb_free_device_list(devs, 1);
+		return 1;
+	}
+	for (j = devs; *j; j++) {
+		if (libusb_get_bus_number(*j) == d->bus_addr[0] &&
+		    libusb_get_device_address(*j) == d->bus_addr[1]) {
+			old = 1;
+			continue;
+		}
+		if (libusb_get_device_descriptor(*j, &desc) ||
+		    !usb_desc_eq_vid_pid(&desc, vid_pid))
+			continue;
+		d->present[d->n_present][0] = libusb_get_bus_number(*j);
+		d->present[d->n_present][1] = libusb_get_device_address(*j);
+		d->n_present++;
+	}
+	libusb_free_device_list(devs, 1);
+	if (!old)
+		d->t = mono_ns();
+	return 0;
+}
+
+/* Waits for the device on old_bus_addr to renumerate, e.g. after firmware was
+ * loaded, until it is back as vid_pid on a new address and can be opened;
+ * timeout_ms == 0 waits forever. Uses a context of its own, the caller's may
+ * lack device discovery. Returns 0 on success, 1 on errors and 2 on timeout. */
+int usb_common_wait_renum(
+	const addr_t old_bus_addr, const addr_t vid_pid, uint64_t t0,
+	unsigned timeout_ms, struct usb_renum *res
+) {
+	struct usb_arrivals a = { .n = 0, };
+	struct usb_departure d = {
+		{ old_bus_addr[0], old_bus_addr[1] }, 0, NULL, 0,
+	};
+	libusb_hotplug_callback_handle cb_left, cb_arrived;
+	libusb_context *ctx;
+	libusb_device_handle *hdev = NULL;
+	libusb_device **devs, **j, *dev = NULL;
+	uint64_t deadline = mono_ns() + timeout_ms * UINT64_C(1000000);
+	uint64_t t_trace = trace_begin();
+	int hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+	int r;
+	unsigned i;
+
+	memset(res, 0, sizeof(*res));
+	if ((r = libusb_init(&ctx))) {
+		fprintf(stderr, "error initializing libusb: %s\n",
+			libusb_error_name(r));
+		return 1;
+	}
+	/* before the callbacks, arrivals in between are enumerated by them */
+	if (usb_renum_snapshot(ctx, &d, vid_pid)) {
+		libusb_exit(ctx);
+		return 1;
+	}
+
+	if (hotplug &&
+	    (r = libusb_hotplug_register_callback(ctx,
+	                LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+	                LIBUSB_HOTPLUG_NO_FLAGS, LIBUSB_HOTPLUG_MATCH_ANY,
+	                LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+	                usb_departed, &d, &cb_left))) {
+		fprintf(stderr, "error registering hotplug callback: %s\n",
+			libusb_error_name(r));
+		hotplug = 0;
+	}
+	if (hotplug &&
+	    (r = libusb_hotplug_register_callback(ctx,
+	                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+	                LIBUSB_HOTPLUG_ENUMERATE, vid_pid[0], vid_pid[1],
+	                LIBUSB_HOTPLUG_MATCH_ANY, usb_arrived, &a,
+	                &cb_arrived))) {
+		fprintf(stderr, "error registering hotplug callback: %s\n",
+			libusb_error_name(r));
+		libusb_hotplug_deregister_callback(ctx, cb_left);
+		hotplug = 0;
+	}
+
+	while (!hdev && (!timeout_ms || mono_ns() < deadline)) {
+		if (hotplug) {
+			libusb_handle_events_timeout(ctx,
+				&(struct timeval){ 0, 10000 });
+		} else {
+			/* no hotplug support, poll the device list */
+			nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+			if (libusb_get_device_list(ctx, &devs) < 0)
+				continue;
+			for (j = devs; *j; j++)
+				if (libusb_get_bus_number(*j) == d.bus_addr[0] &&
+				    libusb_get_device_address(*j) == d.bus_addr[1])
+					break;
+			if (!*j && !d.t)
+				d.t = mono_ns();
+			for (j = devs; *j; j++)
+				if (a.n < ARRAY_SIZE(a.devs) &&
+				    usb_renum_match(*j, &d, vid_pid))
+					a.devs[a.n++] = libusb_ref_device(*j);
+			libusb_free_device_list(devs, 1);
+		}
+		for (i=0; i<a.n; i++) {
+			if (!dev && usb_renum_match(a.devs[i], &d, vid_pid)) {
+				dev = libusb_ref_device(a.devs[i]);
+				res->t_arrived = mono_ns() - t0;
+				res->bus_addr[0] = libusb_get_bus_number(dev);
+				res->bus_addr[1] = libusb_get_device_address(dev);
+			}
+			libusb_unref_device(a.devs[i]);
+		}
+		a.n = 0;
+		/* the node may not be accessible right after the arrival */
+		if (dev && libusb_open(dev, &hdev))
+			hdev = NULL;
+	}
+	res->t_ready = mono_ns() - t0;
+	if (d.t)
+		res->t_gone = d.t - t0;
+	r = hdev ? 0 : 2;
+
+	if (hotplug) {
+		libusb_hotplug_deregister_callback(ctx, cb_arrived);
+		libusb_hotplug_deregister_callback(ctx, cb_left);
+	}
+	if (hdev)
+		libusb_close(hdev);
+	if (dev)
+		libusb_unref_device(dev);
+	free(d.present);
+	libusb_exit(ctx);
+	trace_end("setup", "renumerate", t_trace, "\"ok\":%s",
+	          r ? "false" : "true");
+
+	if (r)
+		fprintf(stderr, "timeout waiting for device to renumerate as "
+			"%04hx:%04hx\n", vid_pid[0], vid_pid[1]);
+	return r;
 }
 
 /*
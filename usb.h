@@ -2,12 +2,14 @@
 #ifndef USB_H
 #define USB_H
 
+#include <stdio.h>
 #include <inttypes.h>
 #include <libusb.h>
 
 #include "common.h"
 
 #define ENV_DEV_ADDR		"USB_DEVICE"
+#define ENV_SETUP_TIMES		"USB_SETUP_TIMES"
 
 typedef uint16_t addr_t[2];
 
@@ -16,6 +18,8 @@ typedef uint16_t addr_t[2];
 struct dev_type {
 	const char *name;
 	addr_t addr;
+	unsigned chunk;		/* bytes per firmware load request, 0: default */
+	unsigned timeout;	/* ms per firmware load request, 0: default */
 };
 
 struct dev_spec {
@@ -32,6 +36,9 @@ struct usb_common {
 	struct dev_spec spec;
 	libusb_context *ctx;
 	libusb_device_handle *hdev;
+	libusb_device *dev;	/* referenced while ctx is alive */
+	int sys_fd;		/* >= 0: usbfs node hdev was wrapped around */
+	int no_discovery;	/* ctx was created w/o device discovery */
 	const struct dev_type *dev_types;
 	const unsigned n_dev_types;
 	int iface, alt;	/* -2: disabled and don't parse args; -1: disabled */
@@ -39,12 +46,50 @@ struct usb_common {
 };
 
 #define USB_COMMON_INIT(dev_types,n_dev_types,iface,alt) \
-	{ DEV_SPEC_INIT, NULL, NULL, (dev_types),(n_dev_types),(iface),(alt),'i','a', }
+	{ DEV_SPEC_INIT, NULL, NULL, NULL, -1, 0, (dev_types),(n_dev_types),(iface),(alt),'i','a', }
+
+/* what usb_common_suspend() keeps around for usb_common_resume() */
+enum usb_keep {
+	USB_KEEP_NONE,		/* full teardown */
+	USB_KEEP_DEVICE,	/* context and device reference, close handle */
+	USB_KEEP_HANDLE,	/* context and open handle, release interface */
+};
+
+/* identifies a device across re-enumeration, when its bus.addr changes */
+struct usb_ident {
+	addr_t vid_pid;
+	char serial[128];	/* empty: match by vid_pid only */
+};
+
+/* outcome of usb_common_wait_renum(), times in ns since the given t0 */
+struct usb_renum {
+	addr_t bus_addr;	/* where the device re-appeared */
+	uint64_t t_gone;	/* 0: departure not observed */
+	uint64_t t_arrived;
+	uint64_t t_ready;	/* could be opened */
+};
 
 /* USB helper functions */
 int usb_common_parse_opts(struct usb_common *uc, int argc, char **argv);
+int usb_common_parse_spec(struct dev_spec *spec, const char *dev_addr);
 int usb_common_setup(struct usb_common *uc);
 void usb_common_teardown(struct usb_common *uc);
+void usb_common_suspend(struct usb_common *uc, enum usb_keep keep);
+int usb_common_resume(struct usb_common *uc);
+
+int usb_common_identify(struct usb_common *uc, struct usb_ident *id);
+int usb_common_reattach(
+	struct usb_common *uc, const struct usb_ident *id, unsigned timeout_ms
+);
+
+int usb_common_wait_renum(
+	const addr_t old_bus_addr, const addr_t vid_pid, uint64_t t0,
+	unsigned timeout_ms, struct usb_renum *res
+);
+
+/* where finding devices reports which one is used and why none could be,
+ * NULL: stderr */
+extern FILE *usb_msg_out;
 
 libusb_device ** usb_common_get_device_list(libusb_context *ctx);
 libusb_device_handle * usb_common_find_device(
@@ -52,6 +97,10 @@ libusb_device_handle * usb_common_find_device(
 	const struct dev_type *dev_types, unsigned n_dev_types
 );
 
+int usb_common_find_ep(
+	libusb_device_handle *hdev, uint8_t ep, int *iface, int *alt
+);
+
 char * usb_common_usage(const struct usb_common *uc);
 char * usb_common_help(const struct usb_common *uc);
 